@@ -0,0 +1,115 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include "Util.hpp"
+#include "ImageMath.h"
+#include "ImageAlgo.h"
+#include "Benchmark.h"
+
+RawImage::ptr Benchmark::synthetic(imgsize_t width, imgsize_t height, unsigned bits, double exposure, uint32_t seed)
+{
+    if ((bits < 8) || (bits > 16)) throw ImageException("benchmark: the bit depth must be between 8 and 16");
+    if ((width < 2) || (height < 2)) throw ImageException("benchmark: the frame must have a 2x2 quad at least");
+
+    static const double response[4] = { 0.45, 1.0, 1.0, 0.6 }; // R G1 G2 B
+    double white = double((1u << bits) - 1);
+    double black = double(1u << (bits - 5));
+    uint32_t state = seed? seed : 1;
+    auto noise = [&state]() // xorshift32: uniform in [-1, 1)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return double(state >> 8) / 8388608.0 - 1;
+    };
+
+    RawImage::ptr frame = RawImage::create(width, height, RawImage::Masked { 0, 0 });
+    frame->name = VA_STR("synthetic" << bits << "bit");
+    for (imgsize_t y = 0; y < height; y++)
+    {
+        bitdepth_t* row = frame->data + std::size_t(y) * width;
+        for (imgsize_t x = 0; x < width; x++)
+        {
+            double signal = (white - black) * exposure * response[(y & 1) * 2 + (x & 1)] * (0.1 + 0.9 * x / width);
+            double level = black + signal + noise() * std::sqrt(signal + 16);
+            row[x] = bitdepth_t(level <= 0? 0 : level >= white? white : level);
+        }
+    }
+    return frame;
+}
+
+std::vector<Benchmark::Result> Benchmark::run(const Setup& setup)
+{
+    if (setup.runs < 1) throw ImageException("benchmark: one run at least is required");
+    RawImage::ptr frameAB = synthetic(setup.width, setup.height, setup.bits, 1.1, 12345);
+    RawImage::ptr frameB = synthetic(setup.width, setup.height, setup.bits, 0.55, 67890); // one EV darker
+    bitdepth_t white = bitdepth_t((1u << setup.bits) - 1);
+    std::vector<double> black { double(1u << (setup.bits - 5)) };
+    ImageAlgo::setBlackLevel(frameAB, black);
+    ImageAlgo::setBlackLevel(frameB, black);
+    ImageAlgo::setWhiteLevel(frameAB, std::make_shared<bitdepth_t>(white));
+
+    double pixels = double(frameAB->pixelCount());
+    double bytes = double(frameAB->length);
+    std::vector<Result> results;
+    auto measure = [&](const std::string& operation, double count, double size, const std::function<void()>& job)
+    {
+        int64_t best = std::numeric_limits<int64_t>::max();
+        for (unsigned r = 0; r < setup.runs; r++)
+        {
+            int64_t start = Util::epochNs();
+            job();
+            int64_t elapsed = Util::epochNs() - start;
+            if (elapsed < best) best = elapsed;
+        }
+        results.push_back(Result { operation, count, size, double(best) / 1e9 });
+    };
+
+    measure("save", pixels, bytes, [&]() { frameAB->save(setup.scratch); });
+    measure("load", pixels, bytes, [&]() { RawImage::load(setup.scratch); });
+    std::remove(setup.scratch.c_str());
+
+    ImageSelection::ptr areaAB = frameAB->getChannel(ImageFilter::RGB())->select();
+    ImageSelection::ptr areaB = frameB->getChannel(ImageFilter::RGB())->select();
+    measure("analyze", pixels, bytes, [&]() { ImageMath::analyze(areaAB); });
+    measure("subtract", pixels, 2 * bytes, [&]() { ImageMath::subtract(areaAB, areaB); });
+
+    ImageMath::Histogram::ptr histogram;
+    measure("buildHistogram", pixels, bytes, [&]() { histogram = ImageMath::buildHistogram(areaAB); });
+    double bins = double(ImageMath::Histogram::levels * sizeof(ImageMath::Histogram::Frequencies::value_type));
+    measure("autoLevels", pixels, bins, [&]() { ImageAlgo::autoLevels(histogram); }); // pixels: the histogram total
+
+    double rgb = double((frameAB->rowPixels / 2) * (frameAB->colPixels / 2) * 3 * sizeof(bitdepth_t));
+    measure("clipping", pixels, bytes + rgb, [&]() { ImageAlgo::clipping(frameAB); });
+
+    ImageAlgo::DPRAW dpraw { frameAB, frameB, white, std::make_shared<double>(1) };
+    measure("dpraw GetA Plain", pixels, 3 * bytes, [&]()
+    {
+        ImageAlgo::dprawProcess(dpraw, ImageAlgo::DPRAW::Action::GetA, ImageAlgo::DPRAW::ProcessMode::Plain);
+    });
+    measure("dpraw Blend Bayer", pixels, 3 * bytes, [&]()
+    {
+        ImageAlgo::dprawProcess(dpraw, ImageAlgo::DPRAW::Action::Blend, ImageAlgo::DPRAW::ProcessMode::Bayer);
+    });
+
+    return results;
+}
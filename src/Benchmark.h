@@ -0,0 +1,53 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCHMARK_H_
+#define BENCHMARK_H_
+
+#include <string>
+#include <vector>
+#include "RawImage.h"
+
+struct Benchmark // timings of the main operations over synthetic frames (regressions visible before a release)
+{
+    struct Setup
+    {
+        imgsize_t width;
+        imgsize_t height;
+        unsigned bits;       // significant bits of the samples (white level: 2^bits - 1)
+        unsigned runs;       // the best time of them is reported
+        std::string scratch; // PGM file written by the save benchmark and read back by the load one (then removed)
+    };
+
+    struct Result
+    {
+        std::string operation;
+        double pixels;  // processed per run
+        double bytes;   // read plus written per run (in memory)
+        double seconds; // best run
+    };
+
+    /* RGGB frame of the given exposure (fraction of the white level reached by the green channel on the right
+     * border), with a horizontal gradient, some noise and the right side of the greens clipped if over one
+     */
+    static RawImage::ptr synthetic(imgsize_t width, imgsize_t height, unsigned bits, double exposure, uint32_t seed);
+
+    static std::vector<Result> run(const Setup& setup);
+};
+
+#endif /* BENCHMARK_H_ */
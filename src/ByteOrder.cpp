@@ -0,0 +1,94 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include "Cpu.hpp"
+#include "ByteOrder.h"
+
+static void swap16Scalar(const uint8_t* source, bitdepth_t* target, std::size_t count)
+{
+    for (std::size_t px = 0; px < count; px++)
+    {
+        bitdepth_t sample;
+        std::memcpy(&sample, source + px * sizeof(sample), sizeof(sample)); // unaligned-safe load
+        target[px] = byteSwap(sample);
+    }
+}
+
+#ifdef HRAW_X86_DISPATCH
+
+HRAW_TARGET("sse2") static void swap16SSE2(const uint8_t* source, bitdepth_t* target, std::size_t count)
+{
+    std::size_t px = 0;
+    for (; px + 8 <= count; px += 8)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + px * 2));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(target + px), v);
+    }
+    swap16Scalar(source + px * 2, target + px, count - px);
+}
+
+HRAW_TARGET("avx2") static void swap16AVX2(const uint8_t* source, bitdepth_t* target, std::size_t count)
+{
+    const __m256i order = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                           1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    std::size_t px = 0;
+    for (; px + 32 <= count; px += 32) // two registers per iteration to hide the load latency
+    {
+        __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + px * 2));
+        __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + px * 2 + 32));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(target + px), _mm256_shuffle_epi8(v0, order));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(target + px + 16), _mm256_shuffle_epi8(v1, order));
+    }
+    swap16Scalar(source + px * 2, target + px, count - px);
+}
+
+HRAW_TARGET("avx512f,avx512bw") static void swap16AVX512(const uint8_t* source, bitdepth_t* target, std::size_t count)
+{
+    const __m512i order = _mm512_set4_epi32(0x0E0F0C0D, 0x0A0B0809, 0x06070405, 0x02030001); // (1,0,3,2,5,4...)
+    std::size_t px = 0;
+    for (; px + 32 <= count; px += 32)
+    {
+        __m512i v = _mm512_loadu_si512(source + px * 2);
+        _mm512_storeu_si512(target + px, _mm512_shuffle_epi8(v, order));
+    }
+    if (px < count) // masked tail
+    {
+        __mmask32 tail = __mmask32((1ull << (count - px)) - 1);
+        __m512i v = _mm512_maskz_loadu_epi16(tail, source + px * 2);
+        _mm512_mask_storeu_epi16(target + px, tail, _mm512_shuffle_epi8(v, order));
+    }
+}
+
+#endif
+
+void ByteOrder::swap16(const void* source, bitdepth_t* target, std::size_t count)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(source);
+#ifdef HRAW_X86_DISPATCH
+    switch (Cpu::simd())
+    {
+        case Cpu::Simd::AVX512: return swap16AVX512(bytes, target, count);
+        case Cpu::Simd::AVX2:   return swap16AVX2(bytes, target, count);
+        case Cpu::Simd::SSE2:   return swap16SSE2(bytes, target, count);
+        case Cpu::Simd::Scalar: break;
+    }
+#endif
+    swap16Scalar(bytes, target, count);
+}
@@ -0,0 +1,39 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BYTEORDER_H_
+#define BYTEORDER_H_
+
+#include <cstddef>
+#include "ImageSelection.h"
+
+struct ByteOrder
+{
+    static bool isBigEndian()
+    {
+        static union { uint16_t i; uint8_t c; } endianness { 0x0102 };
+        return endianness.c == 0x01;
+    }
+
+    /* Copies 'count' 16-bit samples reversing their bytes (the vectorized kernel is selected at runtime).
+     * The source may be unaligned (e.g. a mapped file) and may also be the same buffer as the target.
+     */
+    static void swap16(const void* source, bitdepth_t* target, std::size_t count);
+};
+
+#endif /* BYTEORDER_H_ */
@@ -0,0 +1,73 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CPU_HPP_
+#define CPU_HPP_
+
+#include <cstdlib>
+#include <string>
+#include "Util.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HRAW_X86_DISPATCH // kernels for every x86 instruction set are built and selected at runtime
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized" // false positives from the _mm*_undefined_* idioms
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#define HRAW_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+struct Cpu
+{
+    enum class Simd { Scalar, SSE2, AVX2, AVX512 }; // AVX512 stands for the F+BW subsets
+
+    static Simd simd() // best instruction set available (HRAW_SIMD environment variable may set a lower one)
+    {
+        static const Simd level = detect();
+        return level;
+    }
+
+    static const char* name(Simd level)
+    {
+        return level == Simd::Scalar? "scalar" : level == Simd::SSE2? "sse2" : level == Simd::AVX2? "avx2" : "avx512";
+    }
+
+    private:
+
+        static Simd detect()
+        {
+            Simd level = Simd::Scalar;
+#ifdef HRAW_X86_DISPATCH
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("sse2")) level = Simd::SSE2;
+            if (__builtin_cpu_supports("avx2")) level = Simd::AVX2;
+            if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) level = Simd::AVX512;
+#endif
+            const char* forced = std::getenv("HRAW_SIMD"); // mainly to validate or benchmark the fallbacks
+            if (forced)
+            {
+                std::string name = String::tolower(forced);
+                Simd wanted = name == "scalar"? Simd::Scalar : name == "sse2"? Simd::SSE2 :
+                              name == "avx2"? Simd::AVX2 : Simd::AVX512;
+                if (wanted < level) level = wanted;
+            }
+            return level;
+        }
+};
+
+#endif /* CPU_HPP_ */
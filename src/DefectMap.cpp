@@ -0,0 +1,202 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include "Util.hpp"
+#include "Parallel.h"
+#include "ImageMath.h"
+#include "DefectMap.h"
+
+DefectMap::DefectMap(imgsize_t sensorWidth, imgsize_t sensorHeight, std::vector<Pixel>& sorted)
+  : width(sensorWidth), height(sensorHeight), first(std::size_t(sensorHeight) + 1, 0)
+{
+    pixels.swap(sorted);
+    for (const auto& pixel : pixels) first[pixel.y + 1]++;
+    for (std::size_t y = 0; y < height; y++) first[y + 1] += first[y];
+}
+
+static std::vector<ImageFilter> grids(const Cfa& cfa) // pixels of a single color, sampled at regular intervals
+{
+    std::vector<ImageFilter> result;
+    if (cfa.period() == 2)
+        for (const auto& filter : { ImageFilter::R(), ImageFilter::G1(), ImageFilter::G2(), ImageFilter::B() })
+            result.push_back(cfa.map(filter));
+    else
+        for (auto code : { ImageFilter::Code::R, ImageFilter::Code::G, ImageFilter::Code::B })
+            for (const auto& site : cfa.sites(code)) result.push_back(site);
+    return result;
+}
+
+DefectMap::ptr DefectMap::detect(const RawImage::ptr& dark, const RawImage::ptr& flat, double kappa,
+                                 std::vector<Outliers>& found)
+{
+    if (!dark && !flat) throw ImageException("detect: a dark or a flat frame is required");
+    if (dark && flat && !dark->sameSizeAs(flat)) throw ImageException("detect: dark and flat frames size don't match");
+    const RawImage& sensor = dark? *dark : *flat;
+
+    std::vector<Pixel> defects;
+    for (const RawImage::ptr& frame : { dark, flat })
+    {
+        if (!frame) continue;
+        for (const auto& filter : grids(frame->cfa))
+        {
+            ImageSelection::ptr area = std::make_shared<ImageChannel>(frame, filter)->select(true);
+            auto histogram = ImageMath::buildHistogram(area);
+            const auto& bins = histogram->data;
+            uint64_t half = (histogram->total + 1) / 2;
+            std::size_t median = 0;
+            for (uint64_t seen = bins[0]; seen < half; seen += bins[++median]);
+            std::size_t deviation = 0; // the median of the distances to the median (folded histogram)
+            for (uint64_t seen = bins[median]; seen < half; )
+            {
+                deviation++;
+                if (median + deviation < bins.size()) seen += bins[median + deviation];
+                if (deviation <= median) seen += bins[median - deviation];
+            }
+            Outliers outliers { filter.code, frame == flat, bitdepth_t(median), std::max(1.4826 * double(deviation), 1.0), 0, 0 };
+            double low = frame == flat? double(median) - kappa * outliers.sigma : -1; // (dark pixels are fine)
+            double high = double(median) + kappa * outliers.sigma;
+
+            imgsize_t alignX = frame->bayerStart() % frame->rowPixels; // sensor coordinates of the channel origin
+            imgsize_t alignY = frame->bayerStart() / frame->rowPixels;
+            auto bands = Parallel::split(area->width, area->height);
+            std::vector<std::vector<Pixel>> partial(bands.size());
+            std::vector<Outliers> counts(bands.size(), Outliers { filter.code, false, 0, 0, 0, 0 });
+            Parallel::run(bands.size(), [&](std::size_t b)
+            {
+                std::vector<bitdepth_t> buffer;
+                for (imgsize_t cy = bands[b].y; cy < bands[b].y + bands[b].height; cy++)
+                {
+                    ImageSelection::Span span = area->row(cy, buffer);
+                    imgsize_t y = area->y + cy;
+                    imgsize_t x0 = alignX + area->x * filter.xdelta + (y & 1? filter.xshift_o : filter.xshift_e);
+                    for (imgsize_t cx = 0; cx < span.count; cx++)
+                    {
+                        double dn = span.data[std::size_t(cx) * span.stride];
+                        if ((dn >= low) && (dn <= high)) continue;
+                        (dn < low? counts[b].low : counts[b].high)++;
+                        partial[b].push_back(Pixel { x0 + cx * filter.xdelta, alignY + y * filter.ydelta + filter.yshift });
+                    }
+                }
+            });
+            for (std::size_t b = 0; b < bands.size(); b++)
+            {
+                outliers.low += counts[b].low;
+                outliers.high += counts[b].high;
+                defects.insert(defects.end(), partial[b].begin(), partial[b].end());
+            }
+            found.push_back(outliers);
+        }
+    }
+
+    std::sort(defects.begin(), defects.end(), [](const Pixel& a, const Pixel& b)
+    {
+        return (a.y < b.y) || ((a.y == b.y) && (a.x < b.x));
+    });
+    defects.erase(std::unique(defects.begin(), defects.end(), [](const Pixel& a, const Pixel& b)
+    {
+        return (a.y == b.y) && (a.x == b.x); // (found on both frames)
+    }), defects.end());
+    return ptr(new DefectMap(sensor.rowPixels, sensor.colPixels, defects));
+}
+
+DefectMap::ptr DefectMap::load(const std::string& fileName)
+{
+    std::ifstream in(fileName.c_str());
+    if (!in) throw ImageException(VA_STR("can't open " << fileName));
+    std::string magic;
+    imgsize_t sensorWidth = 0, sensorHeight = 0;
+    std::size_t count = 0;
+    if (!(in >> magic >> sensorWidth >> sensorHeight >> count) || (magic != "HRAW-DEFECTS"))
+        throw ImageException(VA_STR(fileName << ": not a defect map"));
+    if ((count > uint64_t(sensorWidth) * sensorHeight) || (count > std::numeric_limits<uint32_t>::max()))
+        throw ImageException(VA_STR(fileName << ": invalid defects count " << count)); // (32-bit row indexes)
+    std::vector<Pixel> defects; // (growing as read: the count isn't trusted for the allocation)
+    for (std::size_t d = 0; d < count; d++)
+    {
+        Pixel pixel { 0, 0 };
+        bool valid = (in >> pixel.x >> pixel.y) && (pixel.x < sensorWidth) && (pixel.y < sensorHeight);
+        if (!valid || (!defects.empty() && ((pixel.y < defects.back().y)
+                                            || ((pixel.y == defects.back().y) && (pixel.x <= defects.back().x)))))
+            throw ImageException(VA_STR(fileName << ": invalid or unsorted defect #" << d + 1));
+        defects.push_back(pixel);
+    }
+    return ptr(new DefectMap(sensorWidth, sensorHeight, defects));
+}
+
+void DefectMap::save(const std::string& fileName) const
+{
+    std::ofstream out(fileName.c_str());
+    out << "HRAW-DEFECTS " << width << " " << height << " " << pixels.size() << std::endl;
+    for (const auto& pixel : pixels) out << pixel.x << " " << pixel.y << std::endl;
+    if (!out) throw ImageException(VA_STR("error writing " << fileName));
+}
+
+bool DefectMap::contains(imgsize_t x, imgsize_t y) const
+{
+    if ((y >= height) || clean(y)) return false;
+    return std::binary_search(begin(y), end(y), Pixel { x, y }, [](const Pixel& a, const Pixel& b) { return a.x < b.x; });
+}
+
+bitdepth_t DefectMap::replacement(const RawImage& raw, const Pixel& defect) const
+{
+    auto sample = [&raw](imgsize_t x, imgsize_t y) // as stored (see RawImage::swapped)
+    {
+        uint64_t offset = uint64_t(y) * raw.rowPixels + x;
+        bitdepth_t value;
+        if (raw.bytes) std::memcpy(&value, raw.bytes + offset * sizeof(value), sizeof(value)); // (maybe unaligned)
+        else raw.read(offset, 1, &value);
+        return raw.swapped? byteSwap(value) : value;
+    };
+    uint32_t sum = 0, count = 0;
+    auto add = [&](int64_t x, int64_t y)
+    {
+        if ((x < 0) || (y < 0) || (x >= raw.rowPixels) || (y >= raw.colPixels)) return;
+        if (contains(imgsize_t(x), imgsize_t(y))) return;
+        sum += sample(imgsize_t(x), imgsize_t(y));
+        count++;
+    };
+    int64_t period = raw.cfa.period();
+    if (period == 2) // Bayer: the four nearest pixels of the same quad position (G1 and G2 kept apart)
+    {
+        const int64_t around[4][2] = { { -2, 0 }, { 2, 0 }, { 0, -2 }, { 0, 2 } };
+        for (const auto& delta : around) add(int64_t(defect.x) + delta[0], int64_t(defect.y) + delta[1]);
+    }
+    else // the same color sites of the nearest ring around it having any (the adjacent ones of a Quad Bayer block)
+    {
+        imgsize_t x0 = raw.bayerStart() % raw.rowPixels, y0 = raw.bayerStart() / raw.rowPixels; // CFA origin
+        auto color = [&](int64_t x, int64_t y) // (x & y never below -period)
+        {
+            return raw.cfa.color(imgsize_t(x + 2 * period - x0), imgsize_t(y + 2 * period - y0));
+        };
+        char wanted = color(defect.x, defect.y);
+        for (int64_t ring = 1; !count && (ring <= period); ring++)
+            for (int64_t dy = -ring; dy <= ring; dy++)
+                for (int64_t dx = -ring; dx <= ring; dx += (std::abs(dy) == ring)? 1 : 2 * ring)
+                {
+                    int64_t x = int64_t(defect.x) + dx, y = int64_t(defect.y) + dy;
+                    if (color(x, y) == wanted) add(x, y);
+                }
+    }
+    return count? bitdepth_t((sum + count / 2) / count) : sample(defect.x, defect.y); // (nothing better if alone)
+}
@@ -0,0 +1,89 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEFECTMAP_H_
+#define DEFECTMAP_H_
+
+#include <string>
+#include <vector>
+#include "RawImage.h"
+
+/* Hot, dead and stuck pixels of a sensor found on dark and flat frames: their coordinates sorted by row plus the
+ * first one of every row, so the clean rows (almost all) are told apart in constant time. Once attached to a
+ * RawImage they are replaced by the mean of their nearest clean neighbours of the same color as the rows are read
+ * (ImageSelection::row), the clean rows being returned untouched.
+ */
+class DefectMap
+{
+        DefectMap& operator=(const DefectMap&) = delete;
+        DefectMap(const DefectMap&) = delete;
+
+    public:
+
+        typedef std::shared_ptr<const DefectMap> ptr;
+
+        struct Pixel // sensor coordinates (masked pixels included)
+        {
+            imgsize_t x;
+            imgsize_t y;
+        };
+
+        struct Outliers // found in a channel of a frame
+        {
+            ImageFilter::Code channel;
+            bool flat;
+            bitdepth_t median;
+            double sigma;  // robust: 1.4826 times the median absolute deviation (1 ADU at least)
+            uint64_t low;  // below median - kappa * sigma (only searched on flats: dead pixels)
+            uint64_t high; // above median + kappa * sigma (hot or stuck pixels)
+        };
+
+        /* Outliers of every channel (of every site of each color if the CFA period is larger than 2x2) within the
+         * unmasked area of a dark and a flat frame (any of them can be missing), the details added to 'found'
+         */
+        static ptr detect(const RawImage::ptr& dark, const RawImage::ptr& flat, double kappa, std::vector<Outliers>& found);
+
+        static ptr load(const std::string& fileName); // text file: "HRAW-DEFECTS width height count" then "x y" lines
+
+        void save(const std::string& fileName) const;
+
+        bool fits(const RawImage& raw) const { return (raw.rowPixels == width) && (raw.colPixels == height); }
+
+        bool clean(imgsize_t y) const { return first[y] == first[y + 1]; } // no defects in the row
+
+        const Pixel* begin(imgsize_t y) const { return pixels.data() + first[y]; } // defects of a row: [begin, end)
+        const Pixel* end(imgsize_t y) const { return pixels.data() + first[y + 1]; }
+
+        bool contains(imgsize_t x, imgsize_t y) const;
+
+        bitdepth_t replacement(const RawImage& raw, const Pixel& defect) const; // mean of the clean neighbours
+
+        std::size_t size() const { return pixels.size(); }
+
+        const imgsize_t width; // of the sensor
+        const imgsize_t height;
+
+    private:
+
+        DefectMap(imgsize_t sensorWidth, imgsize_t sensorHeight, std::vector<Pixel>& sorted);
+
+        std::vector<Pixel> pixels;  // by row, then by column
+        std::vector<uint32_t> first; // index of the first defect of every row (plus the total)
+};
+
+#endif /* DEFECTMAP_H_ */
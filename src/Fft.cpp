@@ -0,0 +1,104 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <utility>
+#include "Cpu.hpp"
+#include "ImageSelection.h"
+#include "Fft.h"
+
+Fft::Fft(std::size_t points) : n(points), reversed(points), cosines(points? points - 1 : 0), sines(cosines.size())
+{
+    if (!n || (n & (n - 1))) throw ImageException("FFT size must be a power of two");
+    std::size_t bits = 0;
+    while ((std::size_t(1) << bits) < n) bits++;
+    for (std::size_t i = 0; i < n; i++)
+    {
+        std::size_t r = 0;
+        for (std::size_t b = 0; b < bits; b++) if (i & (std::size_t(1) << b)) r |= std::size_t(1) << (bits - 1 - b);
+        reversed[i] = r;
+    }
+    const double pi = std::acos(-1.0);
+    for (std::size_t half = 1; half < n; half *= 2) // stage joining pairs of 'half' points: w = e^(-pi i j / half)
+        for (std::size_t j = 0; j < half; j++)
+        {
+            cosines[half - 1 + j] = std::cos(pi * double(j) / double(half));
+            sines[half - 1 + j] = -std::sin(pi * double(j) / double(half));
+        }
+}
+
+static void butterfliesScalar(double* re, double* im, std::size_t half, const double* wre, const double* wim)
+{
+    for (std::size_t j = 0; j < half; j++)
+    {
+        double tre = re[j + half] * wre[j] - im[j + half] * wim[j];
+        double tim = re[j + half] * wim[j] + im[j + half] * wre[j];
+        re[j + half] = re[j] - tre;
+        im[j + half] = im[j] - tim;
+        re[j] += tre;
+        im[j] += tim;
+    }
+}
+
+#ifdef HRAW_X86_DISPATCH
+
+HRAW_TARGET("avx2")
+static void butterfliesAVX2(double* re, double* im, std::size_t half, const double* wre, const double* wim)
+{
+    std::size_t j = 0;
+    for (; j + 4 <= half; j += 4) // (no FMA: the same rounding as the scalar butterflies)
+    {
+        __m256d cr = _mm256_loadu_pd(wre + j), ci = _mm256_loadu_pd(wim + j);
+        __m256d yr = _mm256_loadu_pd(re + j + half), yi = _mm256_loadu_pd(im + j + half);
+        __m256d xr = _mm256_loadu_pd(re + j), xi = _mm256_loadu_pd(im + j);
+        __m256d tr = _mm256_sub_pd(_mm256_mul_pd(yr, cr), _mm256_mul_pd(yi, ci));
+        __m256d ti = _mm256_add_pd(_mm256_mul_pd(yr, ci), _mm256_mul_pd(yi, cr));
+        _mm256_storeu_pd(re + j + half, _mm256_sub_pd(xr, tr));
+        _mm256_storeu_pd(im + j + half, _mm256_sub_pd(xi, ti));
+        _mm256_storeu_pd(re + j, _mm256_add_pd(xr, tr));
+        _mm256_storeu_pd(im + j, _mm256_add_pd(xi, ti));
+    }
+    butterfliesScalar(re + j, im + j, half - j, wre + j, wim + j);
+}
+
+#endif
+
+void Fft::forward(double* re, double* im) const
+{
+    for (std::size_t i = 0; i < n; i++)
+        if (i < reversed[i])
+        {
+            std::swap(re[i], re[reversed[i]]);
+            std::swap(im[i], im[reversed[i]]);
+        }
+#ifdef HRAW_X86_DISPATCH
+    bool avx2 = Cpu::simd() >= Cpu::Simd::AVX2;
+#endif
+    for (std::size_t half = 1; half < n; half *= 2)
+        for (std::size_t k = 0; k < n; k += 2 * half)
+        {
+#ifdef HRAW_X86_DISPATCH
+            if (avx2 && (half >= 4))
+            {
+                butterfliesAVX2(re + k, im + k, half, cosines.data() + half - 1, sines.data() + half - 1);
+                continue;
+            }
+#endif
+            butterfliesScalar(re + k, im + k, half, cosines.data() + half - 1, sines.data() + half - 1);
+        }
+}
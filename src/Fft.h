@@ -0,0 +1,47 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FFT_H_
+#define FFT_H_
+
+#include <cstddef>
+#include <vector>
+
+/* In-place complex FFT (iterative radix-2, decimation in time) of a power of two size, the real and imaginary parts
+ * kept in separate arrays so the butterflies of a stage run four at a time on AVX2. Plans are read only once built:
+ * a single one can be used from several threads.
+ */
+class Fft
+{
+    public:
+
+        explicit Fft(std::size_t points); // throws ImageException if not a power of two
+
+        void forward(double* re, double* im) const; // unscaled: X[k] = sum of x[n] * e^(-2 pi i k n / N)
+
+        std::size_t size() const { return n; }
+
+    private:
+
+        std::size_t n;
+        std::vector<std::size_t> reversed; // bit reversal permutation
+        std::vector<double> cosines;       // twiddles of every stage one after another (1, 2, 4 ... n/2 of them)
+        std::vector<double> sines;
+};
+
+#endif /* FFT_H_ */
@@ -0,0 +1,54 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/stat.h>
+#include "Util.hpp"
+#include "FrameCache.h"
+
+std::string getLastError();
+
+RawImage::ptr FrameCache::load(const std::string& fileName, const RawImage::Masked::ptr& opticalBlack)
+{
+    struct stat fileInfo;
+    if (stat(fileName.c_str(), &fileInfo)) throw ImageException(VA_STR("opening " << fileName << ": " << getLastError()));
+    uint64_t size = uint64_t(fileInfo.st_size);
+#ifdef __linux__
+    int64_t time = int64_t(fileInfo.st_mtim.tv_sec) * 1000000000 + fileInfo.st_mtim.tv_nsec;
+#else
+    int64_t time = int64_t(fileInfo.st_mtime);
+#endif
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto frame = frames.begin(); frame != frames.end(); ++frame)
+    {
+        if (frame->fileName != fileName) continue;
+        if ((frame->size == size) && (frame->time == time))
+        {
+            frames.splice(frames.begin(), frames, frame); // most recently used
+            return RawImage::share(frame->image, opticalBlack);
+        }
+        frames.erase(frame); // outdated
+        break;
+    }
+
+    // copied (not mapped): a file rewritten in place while mapped could even crash the server
+    auto image = RawImage::load(fileName, RawImage::Masked::ptr(), RawImage::Access::Copy);
+    frames.emplace_front(Frame { fileName, size, time, image });
+    while (frames.size() > capacity) frames.pop_back();
+    return RawImage::share(image, opticalBlack);
+}
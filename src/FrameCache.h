@@ -0,0 +1,50 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMECACHE_H_
+#define FRAMECACHE_H_
+
+#include <list>
+#include <mutex>
+#include "RawImage.h"
+
+class FrameCache // least recently used images evicted first (reloaded if the file changes)
+{
+    public:
+
+        explicit FrameCache(std::size_t frameCount) : capacity(frameCount? frameCount : 1) {}
+
+        // a private RawImage (own mask, black and white levels) sharing the pixels of the cached one (thread safe)
+        RawImage::ptr load(const std::string& fileName, const RawImage::Masked::ptr& opticalBlack);
+
+    private:
+
+        struct Frame
+        {
+            std::string fileName;
+            uint64_t size; // file stamp
+            int64_t time;
+            RawImage::ptr image;
+        };
+
+        std::list<Frame> frames; // most recently used first
+        std::mutex mutex;
+        const std::size_t capacity;
+};
+
+#endif /* FRAMECACHE_H_ */
@@ -19,56 +19,22 @@
 #include <cmath>
 #include <numeric>
 #include <array>
+#include <algorithm>
+#include <limits>
+#include <mutex>
+#include <cstring>
 #include "Util.hpp"
+#include "Parallel.h"
+#include "PixelKernels.h"
+#include "Profile.h"
+#include "Fft.h"
 #include "ImageAlgo.h"
 
-struct ChannelIterators
-{
-    ChannelIterators(const std::shared_ptr<class RawImage>& image, bool unmasked = false)
-      : red(image->getChannel(ImageFilter::R ())->select(unmasked)),
-        gr1(image->getChannel(ImageFilter::G1())->select(unmasked)),
-        gr2(image->getChannel(ImageFilter::G2())->select(unmasked)),
-        blu(image->getChannel(ImageFilter::B ())->select(unmasked))
-    {
-    }
-
-    inline explicit operator bool() const // return false if no more pixels
-    {
-        return red.operator bool(); // assumed all channels in sync (but this one gives you wings ;-)
-    }
-
-    inline void operator++(int) // jump to next pixels
-    {
-        red++;
-        gr1++;
-        gr2++;
-        blu++;
-    }
-
-    ImageSelection::Iterator red;
-    ImageSelection::Iterator gr1;
-    ImageSelection::Iterator gr2;
-    ImageSelection::Iterator blu;
-};
-
-struct ChannelBlacks
-{
-    ChannelBlacks(const ChannelIterators& rgb)
-      : red(rgb.red.selection->channel->blackLevel()),
-        gr1(rgb.gr1.selection->channel->blackLevel()),
-        gr2(rgb.gr2.selection->channel->blackLevel()),
-        blu(rgb.blu.selection->channel->blackLevel())
-    {}
-
-    const double red;
-    const double gr1;
-    const double gr2;
-    const double blu;
-};
-
 void ImageAlgo::setBlackLevel(const RawImage::ptr& image, std::vector<double> blackPoints)
 {
-    if (blackPoints.empty() && image->masked.left) // if not externally supplied compute them from the masked pixels
+    if (blackPoints.empty() && image->masked.left && (image->cfa.period() > 2)) // no R, G1, G2 & B channels
+        blackPoints.emplace_back(ImageMath::analyze(image->getChannel(ImageFilter::RGB())->getLeftMask()).mean);
+    else if (blackPoints.empty() && image->masked.left) // if not externally supplied compute them from the masked pixels
     {
         blackPoints.emplace_back(ImageMath::analyze(image->getChannel(ImageFilter::R())->getLeftMask()).mean);
         blackPoints.emplace_back(ImageMath::analyze(image->getChannel(ImageFilter::G1())->getLeftMask()).mean);
@@ -109,26 +75,28 @@ void ImageAlgo::setWhiteLevel(const RawImage::ptr& image, std::shared_ptr<bitdep
 
 ImageAlgo::Levels ImageAlgo::autoLevels(const ImageMath::Histogram::ptr& histogram)
 {
-    if (histogram->data.empty()) throw ImageException("autoLevels: empty histogram");
+    if (histogram->empty()) throw ImageException("autoLevels: empty histogram");
+    Profile::Scope stage("ImageAlgo::autoLevels", histogram->total, histogram->data.size() * sizeof(uint64_t));
+    const auto& data = histogram->data;
     Levels info { 0, 0, 0 };
     bitdepth_t levels = 0;
-    for (auto itf = histogram->data.cbegin(); itf != histogram->data.cend(); ++itf)
+    for (std::size_t i = histogram->lowest; i <= histogram->highest; i++)
     {
-        if (levels++ < 8) continue;
-        info.blackLevel = bitdepth_t(pow(2, int(log(itf->first) / log(2) + 0.5)));
+        if (!data[i] || (levels++ < 8)) continue;
+        info.blackLevel = bitdepth_t(pow(2, int(log(double(i)) / log(2) + 0.5)));
         break;
     }
     bitdepth_t suspiciousLevel = 0;
-    imgsize_t spike = 1;
-    imgsize_t clippedCount = 0;
-    imgsize_t clipThreshold = 16;
-    bitdepth_t level = bitdepth_t(histogram->data.crbegin()->first + 1);
+    uint64_t spike = 1;
+    uint64_t clippedCount = 0;
+    uint64_t clipThreshold = 16;
     levels = 0;
-    for (auto ritf = histogram->data.crbegin(); ritf != histogram->data.crend(); ++ritf)
+    for (int64_t i = histogram->highest; i >= histogram->lowest; i--)
     {
+        uint64_t pixels = data[std::size_t(i)];
+        if (!pixels) continue;
         if (levels++ > 128) break;
-        level = ritf->first;
-        imgsize_t pixels = ritf->second;
+        bitdepth_t level = bitdepth_t(i);
         clippedCount += pixels;
         if (!info.whiteLevel) info.whiteLevel = level;
         if (pixels > 4)
@@ -145,35 +113,194 @@ ImageAlgo::Levels ImageAlgo::autoLevels(const ImageMath::Histogram::ptr& histogr
     if (suspiciousLevel) info.whiteLevel = suspiciousLevel; else info.clippedCount = 0;
     if (info.clippedCount)
     {
-        auto prevclip = histogram->data.find(info.whiteLevel);
-        if (prevclip != histogram->data.begin())
+        for (int64_t prevclip = int64_t(info.whiteLevel) - 1; prevclip >= histogram->lowest; prevclip--)
         {
-            --prevclip;
-            if (prevclip->second > info.clippedCount / 4) // some channel clipped in the previous level?
+            if (!data[std::size_t(prevclip)]) continue;
+            if (data[std::size_t(prevclip)] > info.clippedCount / 4) // some channel clipped in the previous level?
             {
-                info.clippedCount += prevclip->second; // just in case
-                info.whiteLevel = prevclip->first;
+                info.clippedCount += data[std::size_t(prevclip)]; // just in case
+                info.whiteLevel = bitdepth_t(prevclip);
             }
+            break;
         }
     }
     return info;
 }
 
-RawImage::ptr ImageAlgo::clipping(const RawImage::ptr& input) // assumed RGGB bayer geometry
+void ImageAlgo::fitPTC(PTC& ptc)
+{
+    std::vector<const PTC::Point*> flats, darks;
+    for (const auto& point : ptc.points) (point.dark? darks : flats).push_back(&point);
+    std::sort(flats.begin(), flats.end(), [](const PTC::Point* a, const PTC::Point* b) { return a->signal < b->signal; });
+
+    // the saturation begins where the variance collapses (the clipped pixels no longer add noise)
+    std::size_t usable = 0; // flat pairs below the first clipped one
+    while ((usable < flats.size()) && !flats[usable]->clipped) usable++;
+    std::size_t peak = 0;
+    for (std::size_t p = 1; p < usable; p++) if (flats[p]->variance > flats[peak]->variance) peak = p;
+    std::vector<const PTC::Point*> fit(flats.begin(), flats.begin() + std::ptrdiff_t(usable? peak + 1 : 0));
+    if (fit.size() < 2) throw ImageException("the photon transfer curve requires two unsaturated flat field pairs");
+
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0; // least squares: variance = intercept + signal / gain
+    for (auto list : { &fit, &darks })
+        for (auto point : *list)
+        {
+            n++;
+            sx += point->signal;
+            sy += point->variance;
+            sxx += point->signal * point->signal;
+            sxy += point->signal * point->variance;
+        }
+    double slope = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+    double intercept = (sy - slope * sx) / n;
+    if (!(slope > 0)) throw ImageException("the temporal noise of the flat field pairs doesn't grow with the signal");
+
+    double readVariance = intercept;
+    if (!darks.empty())
+    {
+        readVariance = 0;
+        for (auto point : darks) readVariance += point->variance / double(darks.size());
+    }
+
+    double se = 0, ee = 0; // signal = exposure * response (least squares through the origin)
+    for (auto point : fit) if (point->exposure > 0)
+    {
+        se += point->signal * point->exposure;
+        ee += point->exposure * point->exposure;
+    }
+    ptc.linearity = std::numeric_limits<double>::quiet_NaN();
+    if (ee > 0)
+    {
+        ptc.linearity = 0;
+        for (auto point : fit) if (point->exposure > 0)
+        {
+            double expected = point->exposure * se / ee;
+            ptc.linearity = std::max(ptc.linearity, std::abs(point->signal - expected) * 100 / expected);
+        }
+    }
+
+    ptc.fitted = fit.size();
+    ptc.gain = 1 / slope;
+    ptc.readNoise = std::sqrt(std::max(0.0, readVariance));
+    ptc.fullWell = fit.back()->signal * ptc.gain;
+}
+
+/* Welford's per pixel running moments, the frames walked in chunks of rows so only the accumulators of the chunks
+ * in progress are kept in memory (plus every sample of them for the median and sigma clipping modes). The memory
+ * stays bounded as long as the frames are streamed (RawImage::Access::Stream): their rows are then read on demand.
+ */
+ImageAlgo::Stack ImageAlgo::stack(const std::vector<RawImage::ptr>& frames, Stack::Mode mode, double kappa)
+{
+    if (frames.size() < 2) throw ImageException("stacking requires two frames at least");
+    std::vector<ImageSelection::ptr> planes;
+    for (const auto& frame : frames)
+    {
+        if (!frame->sameSizeAs(frames.front())) throw ImageException(VA_STR(frame->name << ": frames of different size"));
+        planes.push_back(frame->getChannel(ImageFilter::RGB())->select());
+    }
+    imgsize_t width = planes.front()->width;
+    imgsize_t height = planes.front()->height;
+    uint64_t values = uint64_t(width) * height * frames.size();
+    Profile::Scope stage("ImageAlgo::stack", values, (values + 2 * uint64_t(width) * height) * sizeof(bitdepth_t));
+    Stack result { RawImage::create(width, height, RawImage::Masked { 0, 0 }),
+                   RawImage::create(width, height, RawImage::Masked { 0, 0 }) };
+
+    std::size_t count = frames.size();
+    bool sampled = mode != Stack::Mode::Mean; // all the samples of the chunk required
+    uint64_t chunkSize = sampled? (uint64_t(1) << 23) / count : uint64_t(1) << 18; // pixels
+    imgsize_t rows = imgsize_t(std::max(uint64_t(1), chunkSize / width));
+    std::size_t chunks = (height + rows - 1) / rows;
+
+    auto dn = [](double value) { return bitdepth_t(std::min(65535.0, std::round(value))); };
+
+    Parallel::run(chunks, [&](std::size_t chunk)
+    {
+        imgsize_t y = imgsize_t(chunk) * rows;
+        imgsize_t chunkRows = std::min(rows, height - y);
+        std::size_t pixels = std::size_t(chunkRows) * width;
+        std::vector<double> mean(pixels), m2(pixels);
+        std::vector<bitdepth_t> samples(sampled? pixels * count : 0); // pixel major
+        std::vector<bitdepth_t> buffer;
+        for (std::size_t f = 0; f < count; f++)
+        {
+            double weight = 1.0 / double(f + 1);
+            for (imgsize_t r = 0; r < chunkRows; r++)
+            {
+                ImageSelection::Span row = planes[f]->row(y + r, buffer);
+                std::size_t first = std::size_t(r) * width;
+                for (std::size_t px = 0; px < width; px++)
+                {
+                    bitdepth_t sample = row.data[px * row.stride];
+                    double delta = sample - mean[first + px];
+                    mean[first + px] += delta * weight;
+                    m2[first + px] += delta * (sample - mean[first + px]);
+                    if (sampled) samples[(first + px) * count + f] = sample;
+                }
+            }
+        }
+
+        bitdepth_t* average = result.average->data + std::size_t(y) * width;
+        bitdepth_t* stdev = result.stdev->data + std::size_t(y) * width;
+        for (std::size_t p = 0; p < pixels; p++)
+        {
+            double sigma = std::sqrt(m2[p] / double(count - 1)); // sample standard deviation
+            double value = mean[p];
+            bitdepth_t* sample = sampled? &samples[p * count] : nullptr;
+            if (mode == Stack::Mode::Median)
+            {
+                std::nth_element(sample, sample + count / 2, sample + count);
+                value = sample[count / 2];
+                if (count % 2 == 0) value = (value + *std::max_element(sample, sample + count / 2)) / 2;
+            }
+            else if (mode == Stack::Mode::Sigma) // a single clipping iteration around the mean
+            {
+                double sum = 0;
+                std::size_t kept = 0;
+                for (std::size_t f = 0; f < count; f++)
+                    if (std::abs(sample[f] - mean[p]) <= kappa * sigma)
+                    {
+                        sum += sample[f];
+                        kept++;
+                    }
+                if (kept) value = sum / double(kept);
+            }
+            average[p] = dn(value);
+            stdev[p] = dn(sigma);
+        }
+    });
+
+    return result;
+}
+
+/* 16-bit output levels (shared by the images of a batch): straight from the luminance integer part for the usual
+ * 14-bit ADC data, since the gamma correction of higher luminances uses its fractional part too the level of those
+ * integers is refined by the thresholds (in units of 2000 x luminance) where the following levels begin
+ */
+struct GammaTable
+{
+    bitdepth_t whiteLevel;
+    uint64_t blackLevel;             // bit pattern of the (floating point) average black level
+    std::vector<bitdepth_t> output;  // of every integer luminance up to 'top'
+    std::vector<uint32_t> threshold; // of every output level above 14-bit luminances
+    uint32_t top;
+};
+
+RawImage::ptr ImageAlgo::clipping(const RawImage::ptr& input) // any 2x2 CFA
 {
     if (!input->hasBlackLevel()) throw ImageException("clipping: missing black point");
     if (!input->whiteLevel) throw ImageException("clipping: missing white point");
     double avgBlackLevel = input->blackLevel[ImageFilter::Code::RGB];
     bitdepth_t blackLevel = bitdepth_t(std::round(avgBlackLevel));
     bitdepth_t whiteLevel = *input->whiteLevel;
-    ChannelIterators in(input, true);
+    ImageSelection::ptr area = input->getChannel(ImageFilter::R())->select(true);
 
     imgsize_t outputWidth = (input->rowPixels / 2 - input->masked.left) * 3;
     imgsize_t outputHeight = input->colPixels / 2 - input->masked.top;
+    if ((area->width * 3 != outputWidth) || (area->height != outputHeight))
+        throw ImageException("clipping: unsupported optical black area geometry");
     RawImage::ptr copy = RawImage::create(outputWidth, outputHeight, RawImage::Masked{ 0, 0 });
-    ImageChannel::ptr plain = copy->getChannel(ImageFilter::RGB());
-    ImageSelection::ptr full = plain->select();
-    ImageSelection::Iterator out(full);
+    uint64_t pixels = 4 * uint64_t(area->width) * area->height;
+    Profile::Scope stage("ImageAlgo::clipping", pixels, pixels * sizeof(bitdepth_t) + copy->length);
 
     bitdepth_t outclip = 65535; // 16-bit output
     double maxWhite = whiteLevel - avgBlackLevel;
@@ -181,141 +308,222 @@ RawImage::ptr ImageAlgo::clipping(const RawImage::ptr& input) // assumed RGGB ba
 
     auto gamma = [&maxWhite](double adu) -> double { return pow(adu / maxWhite, 1/2.2) * maxWhite; };
 
-    auto glut = std::make_shared<std::array<double, 16384>>(); // fast lookup cache for the usual 14-bit ADC data
-    auto& fastgamma = *glut;
-    for (bitdepth_t adu = 0; adu < fastgamma.size(); adu++) fastgamma[adu] = gamma(adu);
-
-    while (out)
+    static std::mutex cacheMutex;
+    static std::shared_ptr<const GammaTable> cache;
+    std::shared_ptr<const GammaTable> table;
     {
-        bitdepth_t red = in.red++;
-        bitdepth_t gr1 = in.gr1++;
-        bitdepth_t gr2 = in.gr2++;
-        bitdepth_t blu = in.blu++;
-
-        if ((red >= whiteLevel) || (gr1 >= whiteLevel) || (gr2 >= whiteLevel) || (blu >= whiteLevel)) // any burnt subpixel?
+        uint64_t blackBits;
+        std::memcpy(&blackBits, &avgBlackLevel, sizeof(blackBits));
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        if (!cache || (cache->whiteLevel != whiteLevel) || (cache->blackLevel != blackBits))
         {
-            red = red >= whiteLevel? outclip : 0;
-            gr1 = (gr1 >= whiteLevel) || (gr2 >= whiteLevel)? outclip : 0;
-            blu = blu >= whiteLevel? outclip : 0;
+            uint32_t top = uint32_t(std::min(65535.0, std::floor(std::max(0.0, maxWhite)) + 2)); // luminance < maxWhite
+            auto levels = std::make_shared<GammaTable>(GammaTable { whiteLevel, blackBits,
+                                                                   std::vector<bitdepth_t>(std::max(top, 16384u) + 1),
+                                                                   std::vector<uint32_t>(65536), top });
+            auto level = [&](double bw) { return bitdepth_t(gamma(bw) * brightnessAdjust); };
+            for (uint32_t adu = 0; adu < levels->output.size(); adu++) levels->output[adu] = level(adu);
+            for (uint32_t adu = 16384; adu < top; adu++)
+                for (uint32_t next = levels->output[adu] + 1u; next <= levels->output[adu + 1]; next++)
+                {
+                    uint32_t below = adu * 2000, above = below + 2000; // bisection
+                    while (above - below > 1)
+                    {
+                        uint32_t middle = (below + above) / 2;
+                        (level(middle / 2000.0) >= next? above : below) = middle;
+                    }
+                    levels->threshold[next] = above;
+                }
+            cache = levels;
         }
-        else // cheap demosaicing (a quarter of the original resolution)
+        table = cache;
+    }
+    const bitdepth_t* fastgamma = table->output.data();
+    const uint32_t* threshold = table->threshold.data();
+
+    auto render = [&](bitdepth_t red, bitdepth_t gr1, bitdepth_t gr2, bitdepth_t blu) -> bitdepth_t // original arithmetic
+    {
+        red = bitdepth_t(red > blackLevel ? red - blackLevel : 0); // beware of negative noise in the shadows
+        gr1 = bitdepth_t(gr1 > blackLevel ? gr1 - blackLevel : 0);
+        gr2 = bitdepth_t(gr2 > blackLevel ? gr2 - blackLevel : 0);
+        blu = bitdepth_t(blu > blackLevel ? blu - blackLevel : 0);
+        double bw = 0.299 * red + 0.587 * (gr1 + gr2) / 2 + 0.114 * blu; // convert to B&W
+        bitdepth_t adu = bitdepth_t(bw);
+        if (adu < 16384) return fastgamma[adu];
+        bw = gamma(bw) * brightnessAdjust; // gamma correction
+        return bitdepth_t(bw);
+    };
+
+    /* The B&W conversion is done in fixed point: 2000 x luminance = 598 R + 587 (G1 + G2) + 228 B, whose integer
+     * part is exactly the truncated floating point one unless there is no fractional part at all (the floating
+     * point rounding could then leave it just below); those quads are rendered with the original arithmetic
+     */
+    static const uint32_t luminance[] = { 598, 587, 587, 228 };
+    const ImageFilter position[] = { input->cfa.map(ImageFilter::quad[0]), input->cfa.map(ImageFilter::quad[1]),
+                                     input->cfa.map(ImageFilter::quad[2]), input->cfa.map(ImageFilter::quad[3]) };
+    uint32_t weights[4];
+    for (std::size_t c = 0; c < 4; c++) weights[position[c].yshift * 2 + position[c].xshift_e] = luminance[c];
+
+    auto quads = input->getChannel(ImageFilter::RGB())->select(area->x * 2, area->y * 2, area->width * 2, area->height * 2);
+    auto bands = Parallel::split(outputWidth, outputHeight);
+    Parallel::run(bands.size(), [&](std::size_t b)
+    {
+        std::vector<bitdepth_t> buffer0, buffer1;
+        std::vector<uint32_t> mix(area->width);
+        for (imgsize_t cy = bands[b].y; cy < bands[b].y + bands[b].height; cy++)
         {
-            red = bitdepth_t(red > blackLevel ? red - blackLevel : 0); // beware of negative noise in the shadows
-            gr1 = bitdepth_t(gr1 > blackLevel ? gr1 - blackLevel : 0);
-            gr2 = bitdepth_t(gr2 > blackLevel ? gr2 - blackLevel : 0);
-            blu = bitdepth_t(blu > blackLevel ? blu - blackLevel : 0);
-            double bw = 0.299 * red + 0.587 * (gr1 + gr2) / 2 + 0.114 * blu; // convert to B&W
-            bitdepth_t adu = bitdepth_t(bw);
-            bw = adu < fastgamma.size()? fastgamma[adu] : gamma(bw); // gamma correction
-            bw = bw * brightnessAdjust;
-            red = gr1 = blu = bitdepth_t(bw);
+            const bitdepth_t* row0 = quads->row(cy * 2, buffer0).data; // always packed (stride 1)
+            const bitdepth_t* row1 = quads->row(cy * 2 + 1, buffer1).data;
+            PixelKernels::mixQuads(row0, row1, area->width, weights, blackLevel, whiteLevel, mix.data());
+            bitdepth_t* out = copy->data + std::size_t(cy) * outputWidth; // interleaved RGB
+            for (std::size_t cx = 0; cx < mix.size(); cx++, out += 3)
+            {
+                const bitdepth_t* quad[2] = { row0 + 2 * cx, row1 + 2 * cx };
+                auto sample = [&](const ImageFilter& filter) { return quad[filter.yshift][filter.xshift_e]; };
+                if (mix[cx] == PixelKernels::burnt) // any burnt subpixel?
+                {
+                    out[0] = sample(position[0]) >= whiteLevel? outclip : 0;
+                    out[1] = (sample(position[1]) >= whiteLevel) || (sample(position[2]) >= whiteLevel)? outclip : 0;
+                    out[2] = sample(position[3]) >= whiteLevel? outclip : 0;
+                    continue;
+                }
+                uint32_t adu = mix[cx] / 2000;
+                bool tabulated = (mix[cx] % 2000) && (adu < table->top);
+                bitdepth_t bw = fastgamma[adu];
+                if (tabulated && (adu >= 16384))
+                    for (uint32_t next = bw + 1u; next <= fastgamma[adu + 1]; next++)
+                    {
+                        if (mix[cx] >= threshold[next]) bw = bitdepth_t(next);
+                        if ((mix[cx] + 1 >= threshold[next]) && (mix[cx] <= threshold[next] + 1)) tabulated = false;
+                    }
+                if (!tabulated) bw = render(sample(position[0]), sample(position[1]), sample(position[2]), sample(position[3]));
+                out[0] = out[1] = out[2] = bw;
+            }
         }
-
-        out = red;
-        out++;
-        out = gr1;
-        out++;
-        out = blu;
-        out++;
-    }
+    });
 
     return copy;
 }
 
-RawImage::ptr ImageAlgo::dprawProcess(const DPRAW& dpraw, DPRAW::Action action, DPRAW::ProcessMode processMode)
+ImageAlgo::NPS ImageAlgo::noisePowerSpectrum(const ImageSelection::ptr& area, std::size_t tile, std::size_t peaks)
 {
-    if (!dpraw.imgAB->sameSizeAs(dpraw.imgB))
-        throw ImageException("dprawProcess: image and subimage size don't match");
+    if (tile < 4) throw ImageException("noisePowerSpectrum: tiles of 4x4 pixels at least are required");
+    if ((area->width < tile) || (area->height < tile)) throw ImageException("noisePowerSpectrum: area smaller than a tile");
+    Fft fft(tile); // (once the tile is known to fit: its tables are sized by it)
+    std::size_t tilesX = area->width / tile, tilesY = area->height / tile;
+    std::size_t points = tile * tile;
+    NPS nps { tile, tilesX * tilesY, std::vector<double>(points, 0), {}, {}, {}, {} };
+    Profile::Scope stage("ImageAlgo::noisePowerSpectrum", nps.tiles * points, nps.tiles * points * sizeof(bitdepth_t));
 
-    auto newImage = RawImage::layout(dpraw.imgAB);
-    ChannelIterators inAB(dpraw.imgAB);
-    ChannelIterators inB(dpraw.imgB);
-    ChannelIterators out(newImage);
-
-    ChannelBlacks blackAB(inAB);
-    ChannelBlacks blackB(inB);
+    const double pi = std::acos(-1.0);
+    std::vector<double> window(tile), weights(points);
+    for (std::size_t i = 0; i < tile; i++) window[i] = 0.5 - 0.5 * std::cos(2 * pi * double(i) / double(tile)); // Hann
+    double energy = 0; // of the 2D window (the power normalized by it)
+    for (std::size_t i = 0; i < points; i++) energy += (weights[i] = window[i / tile] * window[i % tile]) * weights[i];
 
-    auto white = dpraw.white;
-
-    if (action == DPRAW::Action::GetA) // compute the A subframe subtracting B from AB
+    const std::size_t groups = 64; // (tiles split in a fixed number of groups: results independent of the threads)
+    std::vector<std::vector<double>> partial(std::min(groups, nps.tiles));
+    Parallel::run(partial.size(), [&](std::size_t g)
     {
-        if (processMode == DPRAW::ProcessMode::Plain)
+        std::vector<double>& spectrum = partial[g];
+        spectrum.assign(points, 0);
+        std::vector<double> re(points), im(points), columnRe(tile), columnIm(tile);
+        std::vector<bitdepth_t> buffer;
+        for (std::size_t t = g * nps.tiles / partial.size(); t < (g + 1) * nps.tiles / partial.size(); t++)
         {
-            while (out)
+            auto block = area->select(imgsize_t(t % tilesX * tile), imgsize_t(t / tilesX * tile), imgsize_t(tile), imgsize_t(tile));
+            double mean = 0;
+            for (imgsize_t y = 0; y < tile; y++)
             {
-                out.red = inAB.red >= white? inB.red : 0.5 + (inAB.red - blackAB.red) - (inB.red - blackB.red) + blackB.red;
-                out.gr1 = inAB.gr1 >= white? inB.gr1 : 0.5 + (inAB.gr1 - blackAB.gr1) - (inB.gr1 - blackB.gr1) + blackB.gr1;
-                out.gr2 = inAB.gr2 >= white? inB.gr2 : 0.5 + (inAB.gr2 - blackAB.gr2) - (inB.gr2 - blackB.gr2) + blackB.gr2;
-                out.blu = inAB.blu >= white? inB.blu : 0.5 + (inAB.blu - blackAB.blu) - (inB.blu - blackB.blu) + blackB.blu;
-                out++;
-                inAB++;
-                inB++;
+                ImageSelection::Span span = block->row(y, buffer);
+                for (std::size_t x = 0; x < tile; x++) mean += (re[y * tile + x] = span.data[x * span.stride]);
             }
-        }
-        else // "Bayer" mode
-        {
-            while (out)
+            mean /= double(points);
+            for (std::size_t i = 0; i < points; i++)
             {
-                if ((inAB.red < white) && (inAB.gr1 < white) && (inAB.gr2 < white) && (inAB.blu < white))
-                {
-                    out.red = 0.5 + (inAB.red++ - blackAB.red) - (inB.red++ - blackB.red) + blackB.red;
-                    out.gr1 = 0.5 + (inAB.gr1++ - blackAB.gr1) - (inB.gr1++ - blackB.gr1) + blackB.gr1;
-                    out.gr2 = 0.5 + (inAB.gr2++ - blackAB.gr2) - (inB.gr2++ - blackB.gr2) + blackB.gr2;
-                    out.blu = 0.5 + (inAB.blu++ - blackAB.blu) - (inB.blu++ - blackB.blu) + blackB.blu;
-                    out++;
-                }
-                else // any channel overexposed
-                {
-                    out.red = out.gr1 = out.gr2 = out.blu = white;
-                    out++;
-                    inAB++;
-                    inB++;
-                }
+                re[i] = (re[i] - mean) * weights[i];
+                im[i] = 0;
             }
-        }
-    }
-    else if (action == DPRAW::Action::Blend) // replace AB overexposed areas with B, shifting to match the exposure
-    {
-        double scale = pow(2.0, *dpraw.shiftEV);
-
-        if (processMode == DPRAW::ProcessMode::Plain)
-        {
-            while (out)
+            for (std::size_t y = 0; y < tile; y++) fft.forward(re.data() + y * tile, im.data() + y * tile); // rows
+            for (std::size_t x = 0; x < tile; x++) // then columns
             {
-                out.red = inAB.red >= white? inB.red : 0.5 + (inAB.red - blackAB.red) * scale + blackB.red;
-                out.gr1 = inAB.gr1 >= white? inB.gr1 : 0.5 + (inAB.gr1 - blackAB.gr1) * scale + blackB.gr1;
-                out.gr2 = inAB.gr2 >= white? inB.gr2 : 0.5 + (inAB.gr2 - blackAB.gr2) * scale + blackB.gr2;
-                out.blu = inAB.blu >= white? inB.blu : 0.5 + (inAB.blu - blackAB.blu) * scale + blackB.blu;
-                out++;
-                inAB++;
-                inB++;
+                for (std::size_t y = 0; y < tile; y++) columnRe[y] = re[y * tile + x], columnIm[y] = im[y * tile + x];
+                fft.forward(columnRe.data(), columnIm.data());
+                for (std::size_t y = 0; y < tile; y++)
+                    spectrum[y * tile + x] += columnRe[y] * columnRe[y] + columnIm[y] * columnIm[y];
             }
         }
-        else // "Bayer" mode
+    });
+    double scale = 1.0 / (energy * double(points) * double(nps.tiles)); // (Parseval) sum: the mean tile variance
+    for (const auto& spectrum : partial) for (std::size_t i = 0; i < points; i++) nps.power[i] += spectrum[i] * scale;
+    nps.power[0] = 0;
+
+    auto profile = [&](std::size_t step) // folded: positive and negative frequencies added
+    {
+        std::vector<double> line(tile / 2 + 1);
+        for (std::size_t f = 0; f <= tile / 2; f++)
+            line[f] = nps.power[f * step] + ((f % (tile / 2))? nps.power[(tile - f) * step] : 0);
+        return line;
+    };
+    auto dominant = [&](const std::vector<double>& line)
+    {
+        std::vector<NPS::Peak> found;
+        if (line.size() < 3) return found;
+        std::vector<double> sorted(line.begin() + 1, line.end());
+        std::nth_element(sorted.begin(), sorted.begin() + long(sorted.size() / 2), sorted.end());
+        double median = sorted[sorted.size() / 2];
+        for (std::size_t f = 1; f < line.size(); f++)
+            if ((line[f] > line[f - 1]) && ((f + 1 == line.size()) || (line[f] >= line[f + 1])))
+                found.push_back(NPS::Peak { double(f) / double(tile), line[f], median > 0? line[f] / median : 0 });
+        std::stable_sort(found.begin(), found.end(), [](const NPS::Peak& a, const NPS::Peak& b) { return a.power > b.power; });
+        if (found.size() > peaks) found.resize(peaks);
+        return found;
+    };
+    nps.rows = profile(tile);
+    nps.columns = profile(1);
+    nps.rowPeaks = dominant(nps.rows);
+    nps.columnPeaks = dominant(nps.columns);
+    return nps;
+}
+
+RawImage::ptr ImageAlgo::dprawProcess(const DPRAW& dpraw, DPRAW::Action action, DPRAW::ProcessMode processMode)
+{
+    if (!dpraw.imgAB->sameSizeAs(dpraw.imgB))
+        throw ImageException("dprawProcess: image and subimage size don't match");
+
+    auto newImage = RawImage::layout(dpraw.imgAB);
+    Profile::Scope stage("ImageAlgo::dprawProcess", newImage->pixelCount(false), 3 * uint64_t(newImage->length));
+
+    PixelKernels::DualPixel params;
+    params.getA = action == DPRAW::Action::GetA; // compute the A subframe subtracting B from AB
+    params.wholeQuads = processMode == DPRAW::ProcessMode::Bayer;
+    params.white = dpraw.white;
+    params.scale = params.getA? 1 : pow(2.0, *dpraw.shiftEV); // Blend: AB overexposed areas replaced with B
+    for (const auto& filter : ImageFilter::quad)
+    {
+        ImageChannel::ptr channelAB = dpraw.imgAB->getChannel(filter); // (at its CFA quad position)
+        params.blackAB[channelAB->filter.yshift * 2 + channelAB->filter.xshift_e] = channelAB->blackLevel();
+        ImageChannel::ptr channelB = dpraw.imgB->getChannel(filter);
+        params.blackB[channelB->filter.yshift * 2 + channelB->filter.xshift_e] = channelB->blackLevel();
+    }
+
+    ImageChannel::ptr red = dpraw.imgAB->getChannel(ImageFilter::R());
+    imgsize_t width = red->width(); // quads
+    imgsize_t height = red->height();
+    auto quadsAB = dpraw.imgAB->getChannel(ImageFilter::RGB())->select(0, 0, width * 2, height * 2);
+    auto quadsB = dpraw.imgB->getChannel(ImageFilter::RGB())->select(0, 0, width * 2, height * 2);
+    auto bands = Parallel::split(width * 2, height);
+    Parallel::run(bands.size(), [&](std::size_t b)
+    {
+        std::vector<bitdepth_t> buffers[4];
+        for (imgsize_t qy = bands[b].y; qy < bands[b].y + bands[b].height; qy++)
         {
-            while (out)
-            {
-                if ((inAB.red < white) && (inAB.gr1 < white) && (inAB.gr2 < white) && (inAB.blu < white))
-                {
-                    out.red = 0.5 + (inAB.red++ - blackAB.red) * scale + blackB.red;
-                    out.gr1 = 0.5 + (inAB.gr1++ - blackAB.gr1) * scale + blackB.gr1;
-                    out.gr2 = 0.5 + (inAB.gr2++ - blackAB.gr2) * scale + blackB.gr2;
-                    out.blu = 0.5 + (inAB.blu++ - blackAB.blu) * scale + blackB.blu;
-                    out++;
-                    inB++;
-                }
-                else // any channel overexposed
-                {
-                    out.red = inB.red++;
-                    out.gr1 = inB.gr1++;
-                    out.gr2 = inB.gr2++;
-                    out.blu = inB.blu++;
-                    out++;
-                    inAB++;
-                }
-            }
+            bitdepth_t* row = newImage->data + newImage->bayerStart() + std::size_t(qy) * 2 * newImage->rowPixels;
+            PixelKernels::dualPixel(params, { quadsAB->row(qy * 2, buffers[0]).data, quadsAB->row(qy * 2 + 1, buffers[1]).data },
+                                    { quadsB->row(qy * 2, buffers[2]).data, quadsB->row(qy * 2 + 1, buffers[3]).data },
+                                    { row, row + newImage->rowPixels }, width);
         }
-    }
+    });
 
     return newImage;
 }
@@ -345,3 +553,17 @@ std::istream& operator>>(std::istream& in, ImageAlgo::DPRAW::ProcessMode& proces
     }
     return in;
 }
+
+std::istream& operator>>(std::istream& in, ImageAlgo::Stack::Mode& mode)
+{
+    std::string str;
+    if (in >> str)
+    {
+        str = String::tolower(str);
+             if (!str.compare("mean"))   mode = ImageAlgo::Stack::Mode::Mean;
+        else if (!str.compare("median")) mode = ImageAlgo::Stack::Mode::Median;
+        else if (!str.compare("sigma"))  mode = ImageAlgo::Stack::Mode::Sigma;
+        else in.setstate(std::ios_base::failbit);
+    }
+    return in;
+}
@@ -32,7 +32,7 @@ class ImageAlgo
         {
             bitdepth_t blackLevel;
             bitdepth_t whiteLevel;
-            imgsize_t clippedCount; // amount of clipped pixels
+            uint64_t clippedCount; // amount of clipped pixels
         };
 
         struct DPRAW // Canon Dual Pixel RAW
@@ -45,17 +45,67 @@ class ImageAlgo
             std::shared_ptr<double> shiftEV; // imgAB EV shift for blending
         };
 
+        struct Stack // per pixel statistics of several frames (master dark, bias or flat frames)
+        {
+            enum class Mode { Mean, Median, Sigma }; // Sigma: mean of the samples within kappa standard deviations
+            RawImage::ptr average; // per pixel mean, median or sigma clipped mean
+            RawImage::ptr stdev;   // per pixel standard deviation (of all the samples)
+        };
+
+        struct PTC // photon transfer curve of a channel: temporal noise vs signal of flat field pairs
+        {
+            struct Point // a pair of frames
+            {
+                bool dark;       // no light at all
+                double exposure; // in any linear unit (NaN if unknown)
+                double signal;   // mean DN above the black level
+                double variance; // temporal (half the variance of the pair difference: fixed pattern cancelled)
+                bool clipped;    // white level reached (excluded from the fit)
+            };
+            std::vector<Point> points;
+            std::size_t fitted; // flat pairs below saturation used by the fit
+            double gain;        // e-/DN (inverse of the variance vs signal slope)
+            double readNoise;   // DN (from the dark pairs if any, otherwise the intercept of the fit)
+            double fullWell;    // e- (highest signal before the variance collapses)
+            double linearity;   // worst deviation (%) of the signal from being proportional to the exposure (or NaN)
+        };
+
+        struct NPS // noise power spectrum: averaged 2D power spectra of the tiles of an area
+        {
+            struct Peak // local maximum of a profile
+            {
+                double frequency; // cycles per pixel (of the channel): 0.5 at most
+                double power;     // DN^2
+                double ratio;     // to the median power of the profile (how much it stands out)
+            };
+            std::size_t tile;           // side of the square tiles (a power of two)
+            std::size_t tiles;          // averaged (whole ones, the rest of the area ignored)
+            std::vector<double> power;  // [fy * tile + fx], DC (the mean of every tile) removed: the sum is the variance
+            std::vector<double> rows;   // fy from 0 to tile/2 at fx = 0 (rows offsets: horizontal banding)
+            std::vector<double> columns; // fx from 0 to tile/2 at fy = 0 (columns offsets: vertical banding)
+            std::vector<Peak> rowPeaks;  // dominant frequencies, the strongest first
+            std::vector<Peak> columnPeaks;
+        };
+
         static void setBlackLevel(const RawImage::ptr& image, std::vector<double> blackPoints);
         static void setWhiteLevel(const RawImage::ptr& image, std::shared_ptr<bitdepth_t> whitePoint);
 
         static Levels autoLevels(const ImageMath::Histogram::ptr& histogram);
 
+        static void fitPTC(PTC& ptc); // from its points
+
+        static Stack stack(const std::vector<RawImage::ptr>& frames, Stack::Mode mode, double kappa = 3);
+
         static RawImage::ptr clipping(const RawImage::ptr& input);
 
+        // Hann windowed tiles, their spectra averaged in a fixed order (the same result whatever the thread count)
+        static NPS noisePowerSpectrum(const ImageSelection::ptr& area, std::size_t tile, std::size_t peaks = 3);
+
         static RawImage::ptr dprawProcess(const DPRAW& dpraw, DPRAW::Action action, DPRAW::ProcessMode processMode);
 };
 
 std::istream& operator>>(std::istream& in, ImageAlgo::DPRAW::Action& action);
 std::istream& operator>>(std::istream& in, ImageAlgo::DPRAW::ProcessMode& processMode);
+std::istream& operator>>(std::istream& in, ImageAlgo::Stack::Mode& mode);
 
 #endif /* IMAGEALGO_H_ */
@@ -20,6 +20,8 @@
 #include "ImageChannel.h"
 #include "Util.hpp"
 
+const ImageFilter ImageFilter::quad[4] = { ImageFilter::R(), ImageFilter::G1(), ImageFilter::G2(), ImageFilter::B() };
+
 imgsize_t ImageChannel::width() const
 {
     return raw->bayerWidth() / filter.xdelta;
@@ -49,8 +51,8 @@ ImageSelection::ptr ImageChannel::getLeftMask(bool safetyCrop, bool overlappingT
 {
     if (!raw->masked.left) throw ImageException("getLeftMask: image lacks a left mask");
 
-    imgsize_t factorh = filter.ydelta == 1? 1 : 2;
-    imgsize_t factorw = filter.xdelta == 1? 1 : 2;
+    imgsize_t factorh = filter.ydelta; // (the G channel takes every row)
+    imgsize_t factorw = filter.xdelta;
 
     imgsize_t cy = (overlappingTop? 0 : raw->masked.top) / factorh;
     ImageSelection::ptr leftMask = select(0, cy, raw->masked.left / factorw, height() - cy);
@@ -65,6 +67,84 @@ ImageSelection::ptr ImageChannel::getLeftMask(bool safetyCrop, bool overlappingT
     return leftMask->select(ofsmw, ofsmh, leftMask->width - ofsmw*2, leftMask->height - ofsmh*2);
 }
 
+static const char* layout(Cfa::Pattern pattern) // the rows of a period one after another
+{
+    switch (pattern)
+    {
+        case Cfa::Pattern::RGGB:      return "RG" "GB";
+        case Cfa::Pattern::BGGR:      return "BG" "GR";
+        case Cfa::Pattern::GRBG:      return "GR" "BG";
+        case Cfa::Pattern::GBRG:      return "GB" "RG";
+        case Cfa::Pattern::QuadBayer: return "RRGG" "RRGG" "GGBB" "GGBB";
+        case Cfa::Pattern::XTrans:    return "GGRGGB" "GGBGGR" "BRGRBG" "GGBGGR" "GGRGGB" "RBGBRG";
+    }
+    throw;
+}
+
+imgsize_t Cfa::period() const
+{
+    switch (pattern)
+    {
+        case Pattern::RGGB:
+        case Pattern::BGGR:
+        case Pattern::GRBG:
+        case Pattern::GBRG:      return 2;
+        case Pattern::QuadBayer: return 4;
+        case Pattern::XTrans:    return 6;
+    }
+    throw;
+}
+
+char Cfa::color(imgsize_t x, imgsize_t y) const
+{
+    return layout(pattern)[(y % period()) * period() + x % period()];
+}
+
+ImageFilter Cfa::map(const ImageFilter& filter) const
+{
+    if ((filter.code == ImageFilter::Code::RGB) || (pattern == Pattern::RGGB)) return filter; // (RGGB: the defaults)
+    if (period() != 2) throw ImageException
+    (
+        VA_STR("the " << filter.code << " channel is not defined by a " << pattern << " CFA (no 2x2 period)")
+    );
+    auto column = [this](char filterColor, imgsize_t y) -> imgsize_t { return color(0, y) == filterColor? 0 : 1; };
+    imgsize_t redRow = (color(0, 0) == 'R') || (color(1, 0) == 'R')? 0 : 1;
+    imgsize_t blueRow = 1 - redRow;
+    switch (filter.code)
+    {
+        case ImageFilter::Code::R:  return ImageFilter { filter.code, column('R', redRow), column('R', redRow), redRow, 2, 2 };
+        case ImageFilter::Code::G1: return ImageFilter { filter.code, column('G', 0), column('G', 0), 0, 2, 2 };
+        case ImageFilter::Code::G2: return ImageFilter { filter.code, column('G', 1), column('G', 1), 1, 2, 2 };
+        case ImageFilter::Code::G:  return ImageFilter { filter.code, column('G', 0), column('G', 1), 0, 2, 1 };
+        case ImageFilter::Code::B:  return ImageFilter { filter.code, column('B', blueRow), column('B', blueRow), blueRow, 2, 2 };
+        case ImageFilter::Code::RGB: break;
+    }
+    return filter;
+}
+
+Cfa::Lanes Cfa::lanes() const
+{
+    Lanes lane {{ {{ 0, 1 }}, {{ 2, 3 }} }};
+    for (std::size_t c = 0; c < 4; c++)
+    {
+        ImageFilter position = map(ImageFilter::quad[c]);
+        lane[position.yshift][position.xshift_e] = c;
+    }
+    return lane;
+}
+
+std::vector<ImageFilter> Cfa::sites(ImageFilter::Code code) const
+{
+    if ((period() == 2) || (code == ImageFilter::Code::RGB)) return { map(ImageFilter::create(code)) };
+    char wanted = code == ImageFilter::Code::R? 'R' : code == ImageFilter::Code::G? 'G' : code == ImageFilter::Code::B? 'B' : 0;
+    if (!wanted) throw ImageException(VA_STR("the " << code << " channel is not defined by a " << pattern << " CFA"));
+    std::vector<ImageFilter> result;
+    for (imgsize_t y = 0; y < period(); y++)
+        for (imgsize_t x = 0; x < period(); x++)
+            if (color(x, y) == wanted) result.push_back(ImageFilter { code, x, x, y, period(), period() });
+    return result;
+}
+
 std::istream& operator>>(std::istream& in, ImageFilter::Code& fc)
 {
     std::string str;
@@ -99,3 +179,34 @@ std::ostream& operator<<(std::ostream& out, const ImageFilter::Code& fc)
     }
     throw; // silent pointless gcc warning (potential undefined behaviour not originated here)
 }
+
+std::istream& operator>>(std::istream& in, Cfa::Pattern& pattern)
+{
+    std::string str;
+    if (in >> str)
+    {
+        str = String::toupper(str);
+             if (!str.compare("RGGB"))   pattern = Cfa::Pattern::RGGB;
+        else if (!str.compare("BGGR"))   pattern = Cfa::Pattern::BGGR;
+        else if (!str.compare("GRBG"))   pattern = Cfa::Pattern::GRBG;
+        else if (!str.compare("GBRG"))   pattern = Cfa::Pattern::GBRG;
+        else if (!str.compare("QUAD"))   pattern = Cfa::Pattern::QuadBayer;
+        else if (!str.compare("XTRANS")) pattern = Cfa::Pattern::XTrans;
+        else in.setstate(std::ios_base::failbit);
+    }
+    return in;
+}
+
+std::ostream& operator<<(std::ostream& out, const Cfa::Pattern& pattern)
+{
+    switch (pattern)
+    {
+        case Cfa::Pattern::RGGB:      return out << "RGGB";
+        case Cfa::Pattern::BGGR:      return out << "BGGR";
+        case Cfa::Pattern::GRBG:      return out << "GRBG";
+        case Cfa::Pattern::GBRG:      return out << "GBRG";
+        case Cfa::Pattern::QuadBayer: return out << "QUAD";
+        case Cfa::Pattern::XTrans:    return out << "XTRANS";
+    }
+    throw; // silent pointless gcc warning (as above)
+}
@@ -19,8 +19,10 @@
 #ifndef IMAGECHANNEL_H_
 #define IMAGECHANNEL_H_
 
+#include <array>
 #include <istream>
 #include <ostream>
+#include <vector>
 #include "ImageSelection.h"
 
 struct ImageFilter // allows to represent any (simple) periodic pixel pattern
@@ -42,6 +44,8 @@ struct ImageFilter // allows to represent any (simple) periodic pixel pattern
     static ImageFilter B()   { return ImageFilter { Code::B,   1, 1, 1, 2, 2 }; }
     static ImageFilter RGB() { return ImageFilter { Code::RGB, 0, 0, 0, 1, 1 }; } // full plain image (all pixels)
 
+    static const ImageFilter quad[4]; // R, G1, G2 & B: the quad positions of RGGB (the order of per channel results)
+
     static ImageFilter create(Code code)
     {
         switch (code)
@@ -57,6 +61,32 @@ struct ImageFilter // allows to represent any (simple) periodic pixel pattern
     }
 };
 
+/* Color filter array: the layout of the R, G and B filters over the sensor, repeated every 'period' pixels in both
+ * axes from the first pixel of the Bayer area. The 2x2 patterns map the R, G1, G2, B and G channels to their quad
+ * positions (G1 being the green of the even rows) so the kernels just see a permutation of the four lanes; every
+ * color of the larger ones is instead a set of sites, each a regular grid sampled once per period.
+ */
+struct Cfa
+{
+    enum class Pattern { RGGB, BGGR, GRBG, GBRG, QuadBayer, XTrans };
+
+    explicit Cfa(Pattern layout = Pattern::RGGB) : pattern(layout) {}
+
+    Pattern pattern;
+
+    imgsize_t period() const; // 2 (Bayer), 4 (Quad Bayer) or 6 (X-Trans)
+
+    char color(imgsize_t x, imgsize_t y) const; // 'R', 'G' or 'B' (coordinates within the period)
+
+    ImageFilter map(const ImageFilter& filter) const; // RGB unchanged, the others only defined for a 2x2 period
+
+    std::vector<ImageFilter> sites(ImageFilter::Code code) const; // the single map() one for a 2x2 period
+
+    typedef std::array<std::array<std::size_t, 2>, 2> Lanes;
+
+    Lanes lanes() const; // [row parity][column parity] of a quad: the ImageFilter::quad index of its channel (2x2 only)
+};
+
 class ImageChannel : public std::enable_shared_from_this<ImageChannel> // virtualizes a color channel selection
 {
         ImageChannel& operator=(const ImageChannel&) = delete;
@@ -97,4 +127,7 @@ class ImageChannel : public std::enable_shared_from_this<ImageChannel> // virtua
 std::istream& operator>>(std::istream& in, ImageFilter::Code& fc);
 std::ostream& operator<<(std::ostream& out, const ImageFilter::Code& fc);
 
+std::istream& operator>>(std::istream& in, Cfa::Pattern& pattern);
+std::ostream& operator<<(std::ostream& out, const Cfa::Pattern& pattern);
+
 #endif /* IMAGECHANNEL_H_ */
@@ -17,103 +17,432 @@
  */
 
 #include <cmath>
+#include <cstdlib>
 #include <vector>
+#include <algorithm>
+#include "PixelKernels.h"
+#include "Parallel.h"
+#include "RawImage.h"
+#include "IntegralImage.h"
+#include "Profile.h"
 #include "ImageMath.h"
 
+template <imgsize_t Stride> // 1 or 2 (the rows of every channel) known at compile time, 0 for any other
+static void countStrided(const bitdepth_t* pixel, imgsize_t stride, imgsize_t count, imgsize_t* bins, bool interleave)
+{
+    const std::size_t step = Stride? Stride : stride;
+    imgsize_t cx = 0;
+    if (interleave) // four sub-histograms: repeated levels don't stall on the previous increment
+    {
+        imgsize_t* bins1 = bins + ImageMath::Histogram::levels;
+        imgsize_t* bins2 = bins1 + ImageMath::Histogram::levels;
+        imgsize_t* bins3 = bins2 + ImageMath::Histogram::levels;
+        for (; cx + 4 <= count; cx += 4, pixel += 4 * step)
+        {
+            ++bins[pixel[0]];
+            ++bins1[pixel[step]];
+            ++bins2[pixel[2 * step]];
+            ++bins3[pixel[3 * step]];
+        }
+    }
+    for (; cx < count; cx++, pixel += step) ++bins[*pixel];
+}
+
+static void count(const bitdepth_t* pixel, imgsize_t stride, imgsize_t count, imgsize_t* bins, bool interleave)
+{
+    switch (stride)
+    {
+        case 1:  return countStrided<1>(pixel, stride, count, bins, interleave);
+        case 2:  return countStrided<2>(pixel, stride, count, bins, interleave);
+        default: return countStrided<0>(pixel, stride, count, bins, interleave);
+    }
+}
+
 ImageMath::Histogram::ptr ImageMath::buildHistogram(const ImageSelection::ptr& bitmap)
 {
+    uint64_t scanned = uint64_t(bitmap->width) * bitmap->height;
+    Profile::Scope stage("ImageMath::buildHistogram", scanned, scanned * sizeof(bitdepth_t));
     auto info = std::make_shared<ImageMath::Histogram>();
-    ImageSelection::Iterator pixel(bitmap);
-    std::vector<imgsize_t> fastc(16384);
-    while (pixel) if (pixel < fastc.size()) ++fastc[pixel++]; else ++info->data[pixel++];
-    for (bitdepth_t i = 0; i < fastc.size(); i++) if (fastc[i]) info->data[i] = fastc[i];
+    auto bands = Parallel::split(bitmap->width, bitmap->height);
+    std::size_t tasks = std::min(std::size_t(Parallel::threads()), bands.size()); // counts merge in any order
+    bool interleave = 1.0 * bitmap->width * bitmap->height / double(tasks) >= 4.0 * Histogram::levels;
+    std::size_t ways = interleave? 4 : 1;
+    std::vector<Histogram::Frequencies> partial(tasks, Histogram::Frequencies(ways * Histogram::levels));
+    Parallel::run(tasks, [&](std::size_t t)
+    {
+        std::vector<imgsize_t> bins(ways * Histogram::levels); // 32-bit counters (half the cache footprint)
+        uint64_t pending = 0; // pixels counted by them
+        auto flush = [&]()
+        {
+            for (std::size_t i = 0; i < bins.size(); i++) partial[t][i] += bins[i];
+            std::fill(bins.begin(), bins.end(), 0);
+            pending = 0;
+        };
+        for (std::size_t b = t * bands.size() / tasks; b < (t + 1) * bands.size() / tasks; b++)
+        {
+            uint64_t pixels = uint64_t(bitmap->width) * bands[b].height;
+            if (pending + pixels > std::numeric_limits<imgsize_t>::max()) flush(); // (huge images)
+            bitmap->select(0, bands[b].y, bitmap->width, bands[b].height)->forEachRow(
+                    [&](const bitdepth_t* pixel, imgsize_t stride, imgsize_t count)
+            {
+                ::count(pixel, stride, count, bins.data(), interleave);
+            });
+            pending += pixels;
+        }
+        flush();
+    });
+    info->data.assign(Histogram::levels, 0);
+    for (const auto& bins : partial)
+        for (std::size_t i = 0; i < bins.size(); i++) info->data[i % Histogram::levels] += bins[i];
+
     info->total = 0;
+    info->lowest = 0;
+    info->highest = 0;
     info->mode = 0;
-    imgsize_t modeFreq = 0;
-    imgsize_t level = 0;
+    uint64_t modeFreq = 0;
+    for (std::size_t i = 0; i < info->data.size(); i++)
+    {
+        uint64_t pixels = info->data[i];
+        if (!pixels) continue;
+        if (!info->total) info->lowest = bitdepth_t(i);
+        info->highest = bitdepth_t(i);
+        info->total += pixels;
+        if (pixels > modeFreq) // lowest level on ties
+        {
+            modeFreq = pixels;
+            info->mode = bitdepth_t(i);
+        }
+    }
+    imgsize_t level = 0; // non empty levels walked down from the highest one
     bitdepth_t prevDeltaLevel = 0;
     imgsize_t deltaCum = 0;
     bitdepth_t deltaCnt = 0;
-    for (auto i = info->data.crbegin(); i != info->data.crend(); ++i, ++level)
+    for (int64_t i = info->highest; (i >= info->lowest) && (level <= 160) && info->total; i--)
     {
-        if ((level <= 160) && (level >= 128))
+        if (!info->data[std::size_t(i)]) continue;
+        if (level >= 128)
         {
             if (level > 128)
             {
-                deltaCum += bitdepth_t(prevDeltaLevel - i->first);
+                deltaCum += bitdepth_t(prevDeltaLevel - i);
                 deltaCnt++;
             }
-            prevDeltaLevel = i->first;
-        }
-        info->total += i->second;
-        if (i->second >= modeFreq)
-        {
-            modeFreq = i->second;
-            info->mode = i->first;
+            prevDeltaLevel = bitdepth_t(i);
         }
+        level++;
     }
     info->hDelta = deltaCnt? bitdepth_t(std::round(1.0*deltaCum/deltaCnt)) : 1;
     return info;
 }
 
-ImageMath::Stats1 ImageMath::analyze(const ImageSelection::ptr& bitmap)
+ImageMath::Histogram::Sparse ImageMath::Histogram::sparse() const
 {
-    Stats1 result;
-    ImageSelection::Iterator dn(bitmap);
-    result.max = result.min = dn;
-    long double sum_x = dn;
-    long double sum_x2 = dn * dn; // room for gigapixels
-    while (++dn) // single-pass algorithm
+    Sparse bins;
+    if (!empty())
+        for (std::size_t i = lowest; i <= highest; i++) if (data[i]) bins.emplace_back(bitdepth_t(i), data[i]);
+    return bins;
+}
+
+typedef PixelKernels::Wide Wide;
+
+/* Variance of 'count' integer samples from their (exact) sum and sum of squares: count * sum2 - sum^2 is computed
+ * without any rounding in 128 bits, so there is no cancellation even on near-saturated flats (large mean and tiny
+ * variance) and no long double (slow x87 code) is required
+ */
+static double variance(uint64_t count, uint64_t sum, const Wide& sum2)
+{
+    double samples = double(count);
+    return (Wide::product(count, sum2) - Wide::product(sum, sum)).value() / (samples * samples);
+}
+
+static ImageMath::Stats1 statistics(const PixelKernels::Sums& sums)
+{
+    ImageMath::Stats1 result;
+    result.min = sums.min;
+    result.max = sums.max;
+    result.mean = double(sums.sum) / double(sums.count); // exact conversions (sums below 2^53)
+    result.stdev = std::sqrt(variance(sums.count, sums.sum, sums.sum2));
+    return result;
+}
+
+static PixelKernels::Sums gather(const ImageSelection::ptr& bitmap)
+{
+    uint64_t pixels = uint64_t(bitmap->width) * bitmap->height;
+    auto index = bitmap->channel->raw->index();
+    if (index && index->covers(*bitmap))
     {
-        if (dn > result.max) result.max = dn; else if (dn < result.min) result.min = dn;
-        sum_x += dn;
-        sum_x2 += dn * dn;
+        Profile::Scope stage("ImageMath::analyze indexed", pixels);
+        return index->sums(*bitmap);
     }
-    long double expectedValue = sum_x / bitmap->pixelCount();
-    long double variance = sum_x2 / bitmap->pixelCount() - expectedValue * expectedValue;
-    result.mean = double(expectedValue);
-    result.stdev = double(std::sqrt(variance));
+    Profile::Scope stage("ImageMath::analyze", pixels, pixels * sizeof(bitdepth_t));
+    auto bands = Parallel::split(bitmap->width, bitmap->height);
+    std::vector<PixelKernels::Sums> partial(bands.size());
+    Parallel::run(bands.size(), [&](std::size_t b)
+    {
+        PixelKernels::Sums sums;
+        bitmap->select(0, bands[b].y, bitmap->width, bands[b].height)->forEachRow(
+                [&sums](const bitdepth_t* pixel, imgsize_t stride, imgsize_t count) // single-pass algorithm
+        {
+            PixelKernels::accumulate(pixel, stride, count, sums);
+        });
+        partial[b] = sums;
+    });
+    PixelKernels::Sums sums;
+    for (const auto& band : partial) sums.add(band); // exact integers: same result whatever the thread count
+    return sums;
+}
+
+ImageMath::Stats1 ImageMath::analyze(const ImageSelection::ptr& bitmap)
+{
+    return statistics(gather(bitmap));
+}
+
+ImageMath::Stats1 ImageMath::analyze(const std::vector<ImageSelection::ptr>& bitmaps)
+{
+    PixelKernels::Sums sums;
+    for (const auto& bitmap : bitmaps) sums.add(gather(bitmap));
+    return statistics(sums);
+}
+
+static ImageMath::Stats2 statistics(const PixelKernels::Sums& sumsA, const PixelKernels::Sums& sumsB, const Wide& sum_AB)
+{
+    ImageMath::Stats2 result;
+    result.a = statistics(sumsA);
+    result.b = statistics(sumsB);
+    uint64_t sum_d = sumsA.sum > sumsB.sum? sumsA.sum - sumsB.sum : sumsB.sum - sumsA.sum; // |sum of A - B|
+    Wide sum_d2 = sumsA.sum2 + sumsB.sum2 - (sum_AB + sum_AB); // exact (and positive)
+    result.stdev = std::sqrt(variance(sumsA.count, sum_d, sum_d2) / 2);
     return result;
 }
 
 ImageMath::Stats2 ImageMath::subtract(const ImageSelection::ptr& bitmapA, const ImageSelection::ptr& bitmapB)
 {
     if (!bitmapA->sameAs(bitmapB)) throw ImageException("can't subtract bitmaps of different size/placement");
-    Stats2 result;
-    ImageSelection::Iterator dnA(bitmapA);
-    ImageSelection::Iterator dnB(bitmapB);
-    result.a.max = result.a.min = dnA;
-    result.b.max = result.b.min = dnB;
-    long double sum_A = dnA;
-    long double sum_A2 = dnA * dnA;
-    long double sum_B = dnB;
-    long double sum_B2 = dnB * dnB;
-    double delta = dnA - dnB;
-    long double sum_d = delta;
-    long double sum_d2 = delta * delta;
-    while (++dnA && ++dnB)
-    {
-        if (dnA > result.a.max) result.a.max = dnA; else if (dnA < result.a.min) result.a.min = dnA;
-        sum_A += dnA;
-        sum_A2 += dnA * dnA;
-        if (dnB > result.b.max) result.b.max = dnB; else if (dnB < result.b.min) result.b.min = dnB;
-        sum_B += dnB;
-        sum_B2 += dnB * dnB;
-        delta = dnA - dnB;
-        sum_d += delta;
-        sum_d2 += delta * delta;
+    uint64_t pixels = uint64_t(bitmapA->width) * bitmapA->height;
+    Profile::Scope stage("ImageMath::subtract", pixels, 2 * pixels * sizeof(bitdepth_t));
+    struct Partial { PixelKernels::Sums a, b; Wide ab; };
+    auto bands = Parallel::split(bitmapA->width, bitmapA->height);
+    std::vector<Partial> partial(bands.size());
+    Parallel::run(bands.size(), [&](std::size_t b)
+    {
+        Partial sums;
+        std::vector<bitdepth_t> bufferA, bufferB;
+        for (imgsize_t cy = bands[b].y; cy < bands[b].y + bands[b].height; cy++)
+        {
+            ImageSelection::Span rowA = bitmapA->row(cy, bufferA);
+            ImageSelection::Span rowB = bitmapB->row(cy, bufferB);
+            PixelKernels::accumulate(rowA.data, rowA.stride, rowA.count, sums.a);
+            PixelKernels::accumulate(rowB.data, rowB.stride, rowB.count, sums.b);
+            sums.ab += PixelKernels::dot(rowA.data, rowA.stride, rowB.data, rowB.stride, rowA.count);
+        }
+        partial[b] = sums;
+    });
+    PixelKernels::Sums sumsA, sumsB;
+    Wide sum_AB;
+    for (const auto& band : partial)
+    {
+        sumsA.add(band.a);
+        sumsB.add(band.b);
+        sum_AB += band.ab;
+    }
+    return statistics(sumsA, sumsB, sum_AB);
+}
+
+ImageMath::BayerWindow::BayerWindow(const ImageSelection::ptr& selection) : area(selection)
+{
+    sums = scan(area->x, area->y, area->width, area->height);
+}
+
+ImageMath::BayerWindow::Sums ImageMath::BayerWindow::scan(imgsize_t cx, imgsize_t cy, imgsize_t width, imgsize_t height) const
+{
+    Sums result;
+    if (!width || !height) return result;
+    Cfa::Lanes lane = area->channel->raw->cfa.lanes(); // (the quad position of each channel depends on the CFA)
+
+    uint64_t pixels = 4 * uint64_t(width) * height;
+    auto index = area->channel->raw->index();
+    if (index)
+    {
+        Profile::Scope stage("ImageMath::BayerWindow indexed", pixels);
+        for (std::size_t c = 0; c < 4; c++)
+        {
+            auto window = area->channel->raw->getChannel(ImageFilter::quad[c])->select(cx, cy, width, height);
+            result[c] = index->sums(*window);
+        }
+        return result;
     }
-    auto pixels = bitmapA->pixelCount();
-    long double expectedValue = sum_d / pixels;
-    long double variance = sum_d2 / pixels - expectedValue * expectedValue;
-    result.stdev = double(std::sqrt(variance / 2));
-    expectedValue = sum_A / pixels;
-    variance = sum_A2 / pixels - expectedValue * expectedValue;
-    result.a.mean = double(expectedValue);
-    result.a.stdev = double(std::sqrt(variance));
-    expectedValue = sum_B / pixels;
-    variance = sum_B2 / pixels - expectedValue * expectedValue;
-    result.b.mean = double(expectedValue);
-    result.b.stdev = double(std::sqrt(variance));
+
+    Profile::Scope stage("ImageMath::BayerWindow", pixels, pixels * sizeof(bitdepth_t));
+    auto quads = area->channel->raw->getChannel(ImageFilter::RGB())->select(cx * 2, cy * 2, width * 2, height * 2);
+    auto bands = Parallel::split(width * 2, height);
+    std::vector<Sums> partial(bands.size());
+    Parallel::run(bands.size(), [&](std::size_t b)
+    {
+        Sums band;
+        std::vector<bitdepth_t> buffer;
+        for (imgsize_t qy = bands[b].y; qy < bands[b].y + bands[b].height; qy++)
+            for (imgsize_t parity = 0; parity < 2; parity++)
+            {
+                ImageSelection::Span span = quads->row(qy * 2 + parity, buffer); // always packed (stride 1)
+                PixelKernels::accumulatePairs(span.data, width, band[lane[parity][0]], band[lane[parity][1]]);
+            }
+        partial[b] = band;
+    });
+    for (const auto& band : partial) for (std::size_t c = 0; c < 4; c++) result[c].add(band[c]);
+    return result;
+}
+
+void ImageMath::BayerWindow::move(int deltaX, int deltaY)
+{
+    auto target = area->channel->select(area->x + imgsize_t(deltaX), area->y + imgsize_t(deltaY), area->width, area->height);
+    moved = true;
+
+    auto update = [this](const Sums& entering, const Sums& leaving)
+    {
+        for (std::size_t c = 0; c < 4; c++)
+        {
+            sums[c].add(entering[c]);
+            sums[c].remove(leaving[c]);
+        }
+    };
+
+    imgsize_t width = area->width;
+    imgsize_t height = area->height;
+    imgsize_t x = area->x;
+    imgsize_t y = area->y;
+    imgsize_t dx = imgsize_t(std::abs(int64_t(deltaX)));
+    imgsize_t dy = imgsize_t(std::abs(int64_t(deltaY)));
+
+    auto index = area->channel->raw->index();
+    if (index) for (std::size_t c = 0; c < 4; c++) // constant time
+    {
+        auto window = area->channel->raw->getChannel(ImageFilter::quad[c])->select(target->x, target->y, width, height);
+        sums[c] = index->sums(*window, false);
+    }
+    else if ((dx >= width) || (dy >= height)) sums = scan(target->x, target->y, width, height); // no overlapping
+    else
+    {
+        if (deltaX > 0) update(scan(x + width, y, dx, height), scan(x, y, dx, height)); // horizontal move first
+        else if (deltaX < 0) update(scan(target->x, y, dx, height), scan(x + width - dx, y, dx, height));
+        x = target->x;
+        if (deltaY > 0) update(scan(x, y + height, width, dy), scan(x, y, width, dy));
+        else if (deltaY < 0) update(scan(x, target->y, width, dy), scan(x, y + height - dy, width, dy));
+    }
+    area = target;
+}
+
+ImageMath::StatsRGGB ImageMath::BayerWindow::stats() const
+{
+    std::array<Stats1, 4> result;
+    for (std::size_t c = 0; c < 4; c++)
+    {
+        result[c] = statistics(sums[c]);
+        if (moved) result[c].min = result[c].max = 0;
+    }
+    return StatsRGGB { result[0], result[1], result[2], result[3] };
+}
+
+ImageMath::Stats2RGGB ImageMath::subtractRGGB(const ImageSelection::ptr& areaA, const ImageSelection::ptr& areaB)
+{
+    if (!areaA->sameAs(areaB)) throw ImageException("can't subtract bitmaps of different size/placement");
+    uint64_t pixels = 4 * uint64_t(areaA->width) * areaA->height;
+    Profile::Scope stage("ImageMath::subtractRGGB", pixels, 2 * pixels * sizeof(bitdepth_t));
+    Cfa::Lanes lane = areaA->channel->raw->cfa.lanes(); // [row parity][column parity] of the quad
+
+    struct Partial
+    {
+        std::array<PixelKernels::Sums, 4> a, b;
+        std::array<Wide, 4> ab;
+    };
+    imgsize_t width = areaA->width;
+    auto quadsA = areaA->channel->raw->getChannel(ImageFilter::RGB())->select(areaA->x * 2, areaA->y * 2, width * 2, areaA->height * 2);
+    auto quadsB = areaB->channel->raw->getChannel(ImageFilter::RGB())->select(areaB->x * 2, areaB->y * 2, width * 2, areaB->height * 2);
+    auto bands = Parallel::split(width * 2, areaA->height);
+    std::vector<Partial> partial(bands.size());
+    Parallel::run(bands.size(), [&](std::size_t b)
+    {
+        Partial band;
+        std::vector<bitdepth_t> bufferA, bufferB;
+        for (imgsize_t qy = bands[b].y; qy < bands[b].y + bands[b].height; qy++)
+            for (imgsize_t parity = 0; parity < 2; parity++) // both images rows visited while cached
+            {
+                std::size_t even = lane[parity][0], odd = lane[parity][1];
+                ImageSelection::Span rowA = quadsA->row(qy * 2 + parity, bufferA);
+                ImageSelection::Span rowB = quadsB->row(qy * 2 + parity, bufferB);
+                PixelKernels::accumulatePairs(rowA.data, width, band.a[even], band.a[odd]);
+                PixelKernels::accumulatePairs(rowB.data, width, band.b[even], band.b[odd]);
+                PixelKernels::dotPairs(rowA.data, rowB.data, width, band.ab[even], band.ab[odd]);
+            }
+        partial[b] = band;
+    });
+    Partial sums;
+    for (const auto& band : partial)
+        for (std::size_t c = 0; c < 4; c++)
+        {
+            sums.a[c].add(band.a[c]);
+            sums.b[c].add(band.b[c]);
+            sums.ab[c] += band.ab[c];
+        }
+    std::array<Stats2, 4> result;
+    for (std::size_t c = 0; c < 4; c++) result[c] = statistics(sums.a[c], sums.b[c], sums.ab[c]);
+    return Stats2RGGB { result[0], result[1], result[2], result[3] };
+}
+
+ImageMath::LineMeansRGGB ImageMath::lineMeans(const ImageSelection::ptr& area)
+{
+    uint64_t pixels = 4 * uint64_t(area->width) * area->height;
+    Profile::Scope stage("ImageMath::lineMeans", pixels, pixels * sizeof(bitdepth_t));
+    Cfa::Lanes lane = area->channel->raw->cfa.lanes(); // [row parity][column parity] of the quad
+
+    imgsize_t width = area->width, height = area->height;
+    std::array<std::vector<PixelKernels::Sums>, 4> rows;
+    for (auto& channel : rows) channel.resize(height);
+    auto quads = area->channel->raw->getChannel(ImageFilter::RGB())->select(area->x * 2, area->y * 2, width * 2, height * 2);
+    auto bands = Parallel::split(width * 2, height);
+    std::vector<std::vector<uint64_t>> partial(bands.size()); // column sums of both rows of the quads
+    Parallel::run(bands.size(), [&](std::size_t b)
+    {
+        std::vector<bitdepth_t> buffer;
+        std::vector<uint32_t> columns(std::size_t(width) * 4, 0); // 32-bit sums: every row of a quad added to them
+        std::vector<uint64_t>& total = partial[b];
+        total.assign(columns.size(), 0);
+        auto flush = [&]()
+        {
+            for (std::size_t i = 0; i < columns.size(); i++) total[i] += columns[i];
+            std::fill(columns.begin(), columns.end(), 0);
+        };
+        for (imgsize_t qy = bands[b].y, pending = 0; qy < bands[b].y + bands[b].height; qy++, pending++)
+        {
+            if (pending == 65536) flush(), pending = 0; // (before the 32-bit sums could overflow)
+            for (imgsize_t parity = 0; parity < 2; parity++)
+            {
+                ImageSelection::Span span = quads->row(qy * 2 + parity, buffer); // always packed (stride 1)
+                PixelKernels::accumulatePairs(span.data, width, rows[lane[parity][0]][qy], rows[lane[parity][1]][qy]);
+                PixelKernels::addColumns(span.data, width * 2, columns.data() + parity * std::size_t(width) * 2);
+            }
+        }
+        flush();
+    });
+
+    LineMeansRGGB result;
+    for (std::size_t c = 0; c < 4; c++)
+    {
+        PixelKernels::Sums sums;
+        result.rows[c].resize(height);
+        for (imgsize_t qy = 0; qy < height; qy++)
+        {
+            result.rows[c][qy] = double(rows[c][qy].sum) / double(width);
+            sums.add(rows[c][qy]);
+        }
+        result.pixels[c] = statistics(sums);
+        result.columns[c].assign(width, 0);
+    }
+    for (const auto& band : partial)
+        for (std::size_t i = 0; i < band.size(); i++) // [parity][quad column * 2 + column parity]
+        {
+            std::size_t parity = i / (std::size_t(width) * 2), column = i % (std::size_t(width) * 2);
+            result.columns[lane[parity][column & 1]][column / 2] += double(band[i]);
+        }
+    for (auto& channel : result.columns) for (auto& mean : channel) mean /= height;
     return result;
 }
@@ -19,7 +19,11 @@
 #ifndef IMAGEMATH_H_
 #define IMAGEMATH_H_
 
-#include <map>
+#include <array>
+#include <limits>
+#include <vector>
+#include <utility>
+#include "PixelKernels.h"
 #include "ImageSelection.h"
 
 class ImageMath
@@ -41,19 +45,82 @@ class ImageMath
             double stdev; // of the subtraction
         };
 
+        struct StatsRGGB // the four bayer channels of the same area
+        {
+            Stats1 r;
+            Stats1 g1;
+            Stats1 g2;
+            Stats1 b;
+        };
+
+        struct Stats2RGGB // the four bayer channels of the same area of two images
+        {
+            Stats2 r;
+            Stats2 g1;
+            Stats2 g2;
+            Stats2 b;
+        };
+
+        /* Fused statistics of the R, G1, G2 and B channels of an area, gathered in a single pass over the 2x2 quads.
+         * When moved only the entering and leaving pixels are visited: mean and stdev remain exact but min and max
+         * are no longer available (reported as zero) after the first move.
+         */
+        class BayerWindow
+        {
+            public:
+
+                explicit BayerWindow(const ImageSelection::ptr& area); // on any of the R, G1, G2 or B channels
+
+                void move(int deltaX, int deltaY); // coordinates of the channels (quads)
+
+                StatsRGGB stats() const;
+
+                ImageSelection::ptr area;
+
+            private:
+
+                typedef std::array<PixelKernels::Sums, 4> Sums; // R, G1, G2, B
+
+                Sums scan(imgsize_t cx, imgsize_t cy, imgsize_t width, imgsize_t height) const;
+
+                Sums sums;
+                bool moved = false;
+        };
+
+        struct LineMeansRGGB // the four bayer channels of the same area: R, G1, G2, B
+        {
+            std::array<std::vector<double>, 4> rows;    // mean of every row
+            std::array<std::vector<double>, 4> columns; // mean of every column
+            std::array<Stats1, 4> pixels;               // the whole area
+        };
+
+        // gathered in a single pass over the quads of an area selected on any of the R, G1, G2 or B channels
+        static LineMeansRGGB lineMeans(const ImageSelection::ptr& area);
+
         struct Histogram
         {
             typedef std::shared_ptr<Histogram> ptr;
-            typedef std::map<bitdepth_t, imgsize_t> Frequencies;
+            typedef std::vector<uint64_t> Frequencies; // dense: one bin for every possible level
+            typedef std::vector<std::pair<bitdepth_t, uint64_t>> Sparse; // non empty bins (ascending levels)
+            static constexpr std::size_t levels = std::size_t(std::numeric_limits<bitdepth_t>::max()) + 1;
             Frequencies data;
-            imgsize_t total;
+            uint64_t total;
+            bitdepth_t lowest; // first non empty level
+            bitdepth_t highest; // last non empty level
             bitdepth_t mode; // statistical mode
             bitdepth_t hDelta; // highlights compression detected if > 1
+
+            bool empty() const { return total == 0; }
+            Sparse sparse() const;
         };
 
         static Histogram::ptr buildHistogram(const ImageSelection::ptr& bitmap);
-        static Stats1 analyze(const ImageSelection::ptr& bitmap);
+        static Stats1 analyze(const ImageSelection::ptr& bitmap); // exact integer sums: no tolerance required
+        static Stats1 analyze(const std::vector<ImageSelection::ptr>& bitmaps); // all of them as a whole
         static Stats2 subtract(const ImageSelection::ptr& bitmapA, const ImageSelection::ptr& bitmapB);
+
+        // subtract() of the four channels of two areas (selected on any of the R, G1, G2 or B channels) in one pass
+        static Stats2RGGB subtractRGGB(const ImageSelection::ptr& areaA, const ImageSelection::ptr& areaB);
 };
 
 #endif /* IMAGEMATH_H_ */
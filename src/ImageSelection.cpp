@@ -16,10 +16,13 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cstring>
 #include "Util.hpp"
+#include "ByteOrder.h"
 #include "RawImage.h"
 #include "ImageChannel.h"
 #include "ImageSelection.h"
+#include "DefectMap.h"
 
 ImageSelection::ImageSelection(const std::shared_ptr<const ImageChannel>& imageChannel, const ImageCrop& crop)
   : ImageCrop(crop), channel(imageChannel)
@@ -59,26 +62,88 @@ bitdepth_t& ImageSelection::pixel(imgsize_t cx, imgsize_t cy) const
 {
     if (cx >= width) throw ImageException(VA_STR("out of range: X(" << cx << ") beyond " << width - 1));
     if (cy >= height) throw ImageException(VA_STR("out of range: Y(" << cy << ") beyond " << height - 1));
+    if (!channel->raw->data) // (a reference to an unaligned sample can't be given either)
+        throw ImageException("random access to the pixels of a streamed or unaligned mapped image (see Iterator)");
+    if (channel->raw->defects) throw ImageException("random access to the pixels of an image with defects (see row)");
     const ImageFilter& bayer = channel->filter;
-    auto offset = ((y + cy) * bayer.ydelta + bayer.yshift) * channel->raw->rowPixels +
-                   (x + cx) * bayer.xdelta + ((y + cy) & 1? bayer.xshift_o : bayer.xshift_e);
+    std::size_t offset = (std::size_t(y + cy) * bayer.ydelta + bayer.yshift) * channel->raw->rowPixels +
+                         std::size_t(x + cx) * bayer.xdelta + ((y + cy) & 1? bayer.xshift_o : bayer.xshift_e);
     return channel->raw->data[channel->raw->bayerStart() + offset];
 }
 
+ImageSelection::Span ImageSelection::row(imgsize_t cy, std::vector<bitdepth_t>& buffer) const
+{
+    Span span = samples(cy, buffer);
+    const RawImage& image = *channel->raw;
+    if (!image.defects) return span;
+
+    const ImageFilter& bayer = channel->filter; // sensor coordinates of the row
+    imgsize_t sensorY = image.bayerStart() / image.rowPixels + (y + cy) * bayer.ydelta + bayer.yshift;
+    if (image.defects->clean(sensorY)) return span; // (the usual case: a single check per row)
+    imgsize_t firstX = image.bayerStart() % image.rowPixels + x * bayer.xdelta + ((y + cy) & 1? bayer.xshift_o : bayer.xshift_e);
+
+    if ((span.data != buffer.data()) || (span.stride != 1)) // a packed copy to be patched
+    {
+        buffer.resize(width);
+        for (std::size_t cx = 0; cx < width; cx++) buffer[cx] = span.data[cx * span.stride];
+    }
+    for (const DefectMap::Pixel* defect = image.defects->begin(sensorY); defect != image.defects->end(sensorY); defect++)
+    {
+        if ((defect->x < firstX) || ((defect->x - firstX) % bayer.xdelta)) continue;
+        imgsize_t cx = (defect->x - firstX) / bayer.xdelta;
+        if (cx < width) buffer[cx] = image.defects->replacement(image, *defect);
+    }
+    return Span { buffer.data(), 1, width };
+}
+
+ImageSelection::Span ImageSelection::samples(imgsize_t cy, std::vector<bitdepth_t>& buffer) const
+{
+    if (cy >= height) throw ImageException(VA_STR("out of range: Y(" << cy << ") beyond " << height - 1));
+    const ImageFilter& bayer = channel->filter;
+    const RawImage& image = *channel->raw;
+
+    const bitdepth_t* plane = image.plane(bayer);
+    if (plane) return Span { plane + std::size_t(y + cy) * channel->width() + x, 1, width }; // deinterleaved
+
+    std::size_t offset = (std::size_t(y + cy) * bayer.ydelta + bayer.yshift) * image.rowPixels
+                       + std::size_t(x) * bayer.xdelta + ((y + cy) & 1? bayer.xshift_o : bayer.xshift_e);
+    if (!image.bytes) // streamed: the row read from the file (then converted and packed)
+    {
+        buffer.resize(std::size_t(width - 1) * bayer.xdelta + 1);
+        image.read(image.bayerStart() + offset, buffer.size(), buffer.data());
+        if (bayer.xdelta == 1) { if (image.swapped) ByteOrder::swap16(buffer.data(), buffer.data(), width); }
+        else for (std::size_t cx = 0; cx < width; cx++)
+            buffer[cx] = image.swapped? byteSwap(buffer[cx * bayer.xdelta]) : buffer[cx * bayer.xdelta];
+        return Span { buffer.data(), 1, width };
+    }
+
+    if (image.data && !image.swapped) return Span { image.data + image.bayerStart() + offset, bayer.xdelta, width };
+
+    const uint8_t* first = image.bytes + (image.bayerStart() + offset) * sizeof(bitdepth_t); // (maybe unaligned)
+    buffer.resize(std::size_t(width - 1) * bayer.xdelta + 1); // mapped file: converted (and packed) row
+    if (image.swapped) ByteOrder::swap16(first, buffer.data(), buffer.size()); // (unaligned-safe loads)
+    else std::memcpy(buffer.data(), first, buffer.size() * sizeof(bitdepth_t));
+    if (bayer.xdelta != 1) for (std::size_t cx = 1; cx < width; cx++) buffer[cx] = buffer[cx * bayer.xdelta];
+    return Span { buffer.data(), 1, width };
+}
+
 ImageSelection::Iterator::Iterator(const std::shared_ptr<ImageSelection>& imageSelection) : selection(imageSelection)
 {
     auto& image = selection->channel;
     const ImageFilter& bayer = image->filter;
+    if (!image->raw->bytes) throw ImageException("random access to the pixels of a streamed image");
+    if (image->raw->defects) throw ImageException("in-situ access to the pixels of an image with defects (see row)");
 
     auto xshift = selection->y & 1? bayer.xshift_o : bayer.xshift_e;
     yskipShift = (selection->y & 1? bayer.xshift_e : bayer.xshift_o) - xshift;
 
-    rawStartOffset = image->raw->data + image->raw->bayerStart()
-                   + (selection->y * bayer.ydelta + bayer.yshift) * image->raw->rowPixels
-                   +  selection->x * bayer.xdelta + xshift;
+    rawStartOffset = image->raw->bytes + sizeof(bitdepth_t) * (image->raw->bayerStart()
+                   + (std::size_t(selection->y) * bayer.ydelta + bayer.yshift) * image->raw->rowPixels
+                   +  std::size_t(selection->x) * bayer.xdelta + xshift);
 
     yskip = imgsize_t(image->raw->rowPixels * bayer.ydelta - (selection->width - 1) * bayer.xdelta);
     xskip = bayer.xdelta;
+    swapped = image->raw->swapped;
 
     rewind();
 }
@@ -20,13 +20,17 @@
 #define IMAGESELECTION_H_
 
 #include <cstdint>
+#include <cstring>
 #include <stdexcept>
 #include <string>
 #include <memory>
+#include <vector>
 
 typedef uint16_t bitdepth_t; // enough for 16-bit ADC
 typedef uint32_t imgsize_t;
 
+inline bitdepth_t byteSwap(bitdepth_t value) { return bitdepth_t(value >> 8 | value << 8); }
+
 class ImageException : public std::logic_error
 {
     public:
@@ -60,15 +64,45 @@ class ImageSelection : public ImageCrop // virtualizes a image area selection wi
         ImageSelection::ptr select(imgsize_t cx, imgsize_t cy, imgsize_t subSelWidth, imgsize_t subSelHeight) const;
 
         bitdepth_t& pixel(imgsize_t cx, imgsize_t cy) const; // for random access (5-10 times slower upon compilers)
+                                                             // note: stored as is (see RawImage::swapped)
+                                                             // (refused if the RawImage has defects: use row)
 
         bool sameAs(const ImageSelection::ptr& that) const
         {
             return (width == that->width) && (height == that->height) && (x == that->x) && (y == that->y);
         }
 
-        imgsize_t pixelCount() const
+        uint64_t pixelCount() const
         {
-            return width * height;
+            return uint64_t(width) * height;
+        }
+
+        struct Span // a single row of the selection
+        {
+            const bitdepth_t* data; // first pixel
+            imgsize_t stride;       // distance between consecutive pixels
+            imgsize_t count;        // selection width
+        };
+
+        Span row(imgsize_t cy, std::vector<bitdepth_t>& buffer) const; // buffer used if conversion required
+                                                                       // (or replacing the RawImage defects)
+
+        /* High-performance row-oriented read-only access, suitable for tight (vectorizable) loops
+         *
+         *     uint64_t sum = 0;
+         *     bitmap->forEachRow([&sum](const bitdepth_t* pixel, imgsize_t stride, imgsize_t count)
+         *     {
+         *         for (imgsize_t cx = 0; cx < count; cx++) sum += pixel[cx * stride];
+         *     });
+         */
+        template <typename RowFunction> void forEachRow(RowFunction rowFunction) const
+        {
+            std::vector<bitdepth_t> buffer;
+            for (imgsize_t cy = 0; cy < height; cy++)
+            {
+                Span span = row(cy, buffer);
+                rowFunction(span.data, span.stride, span.count);
+            }
         }
 
         /* High-performance sequential in-situ fetching of all pixels from left to right and top to bottom
@@ -85,6 +119,8 @@ class ImageSelection : public ImageCrop // virtualizes a image area selection wi
          *         pixel = pixel * pixel; // modify the current pixel (as number gets the current pixel value)
          *         printSquared(pixel++); // post-increment: gets the current pixel value and goes to the next pixel
          *     }
+         *
+         * The pixels are the stored ones, so an image with defects (RawImage::defects) is refused: use row() instead
          */
         class Iterator
         {
@@ -101,8 +137,9 @@ class ImageSelection : public ImageCrop // virtualizes a image area selection wi
                 inline operator bitdepth_t() const // automatic conversion to return the current pixel value
                 {
                     if (!nextRow) throw ImageException("No pixel!");
-                    bitdepth_t pixelValue = *rawData;
-                    return pixelValue;
+                    bitdepth_t pixelValue;
+                    std::memcpy(&pixelValue, rawData, sizeof(pixelValue)); // (mapped pixels may be unaligned)
+                    return swapped? byteSwap(pixelValue) : pixelValue; // mapped files are converted on the fly
                 }
 
                 inline bitdepth_t operator++(int) // gets the current pixel value plus advances to the next pixel
@@ -122,7 +159,8 @@ class ImageSelection : public ImageCrop // virtualizes a image area selection wi
                 {
                     if (!nextRow) throw ImageException("No pixel!");
                     bitdepth_t integerValue = (bitdepth_t) pixelValue; // no need to cast on client side
-                    *rawData = integerValue;
+                    bitdepth_t stored = swapped? byteSwap(integerValue) : integerValue;
+                    std::memcpy(rawData, &stored, sizeof(stored));
                     return integerValue;
                 }
 
@@ -133,11 +171,11 @@ class ImageSelection : public ImageCrop // virtualizes a image area selection wi
 
                 inline void next() // fast position update accounting for the Bayer geometry
                 {
-                    if (--nextColumn) rawData += xskip;
+                    if (--nextColumn) rawData += sizeof(bitdepth_t) * xskip;
                     else
                     {
                         nextColumn = selection->width; // this code executed a single time per row of pixels
-                        rawData += yskipNext;
+                        rawData += sizeof(bitdepth_t) * yskipNext;
                         std::swap(yskipNext, yskipPrev);
                         nextRow--;
                     }
@@ -159,17 +197,22 @@ class ImageSelection : public ImageCrop // virtualizes a image area selection wi
 
             private:
 
-                bitdepth_t* rawStartOffset;
+                uint8_t* rawStartOffset; // the samples as bytes (mapped ones may be unaligned)
+                bool swapped;
                 imgsize_t xskip;
                 imgsize_t yskip;
                 imgsize_t yskipShift;
 
-                bitdepth_t* rawData;
+                uint8_t* rawData;
                 imgsize_t yskipNext;
                 imgsize_t yskipPrev;
                 imgsize_t nextColumn;
                 imgsize_t nextRow;
         };
+
+    private:
+
+        Span samples(imgsize_t cy, std::vector<bitdepth_t>& buffer) const; // row() as found in the image
 };
 
 #endif /* IMAGESELECTION_H_ */
@@ -0,0 +1,307 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "Parallel.h"
+#include "RawImage.h"
+#include "IntegralImage.h"
+
+// the tables (and the sidecar) are laid out by quad position, whatever the CFA: ImageFilter::quad
+static ImageChannel::ptr position(const RawImage& raw, std::size_t c) // (not remapped by the CFA of the image)
+{
+    return std::make_shared<ImageChannel>(raw.shared_from_this(), ImageFilter::quad[c]);
+}
+
+struct SidecarHeader // followed by the tables
+{
+    char magic[8];
+    uint32_t byteOrder; // 0x01020304 as written by the host
+    uint32_t rowPixels; // source image geometry
+    uint32_t colPixels;
+    uint32_t bayerStart;
+    uint32_t width;     // of each channel
+    uint32_t height;
+    uint64_t imageSize; // source file stamp
+    int64_t imageTime;  // (nanoseconds where available)
+    uint64_t reserved[2];
+};
+
+static const char sidecarMagic[8] = { 'H', 'R', 'A', 'W', 'S', 'A', 'T', '1' };
+
+static bool stamp(const std::string& imageFile, uint64_t& size, int64_t& time)
+{
+    struct stat fileInfo;
+    if (stat(imageFile.c_str(), &fileInfo)) return false;
+    size = uint64_t(fileInfo.st_size);
+#ifdef __linux__
+    time = int64_t(fileInfo.st_mtim.tv_sec) * 1000000000 + fileInfo.st_mtim.tv_nsec; // (same second rewrites)
+#else
+    time = int64_t(fileInfo.st_mtime);
+#endif
+    return true;
+}
+
+static SidecarHeader header(const RawImage& raw, const std::string& imageFile)
+{
+    SidecarHeader info;
+    std::memset(&info, 0, sizeof(info));
+    std::memcpy(info.magic, sidecarMagic, sizeof(info.magic));
+    info.byteOrder = 0x01020304;
+    info.rowPixels = raw.rowPixels;
+    info.colPixels = raw.colPixels;
+    info.bayerStart = raw.bayerStart();
+    info.width = raw.bayerWidth() / 2;
+    info.height = raw.bayerHeight() / 2;
+    if (!stamp(imageFile, info.imageSize, info.imageTime)) info.imageSize = 0;
+    return info;
+}
+
+IntegralImage::IntegralImage(imgsize_t channelWidth, imgsize_t channelHeight, uint64_t* tables,
+                             const std::shared_ptr<void>& memory)
+  : width(channelWidth), height(channelHeight),
+    tilesX((channelWidth + tile - 1) / tile), tilesY((channelHeight + tile - 1) / tile),
+    storage(memory)
+{
+    std::size_t tableSize = (std::size_t(width) + 1) * (std::size_t(height) + 1);
+    std::size_t channelSize = tablesSize(width, height) / 4;
+    for (std::size_t c = 0; c < 4; c++)
+    {
+        sum[c] = tables + c * channelSize;
+        sum2[c] = sum[c] + tableSize;
+        range[c] = reinterpret_cast<bitdepth_t*>(sum2[c] + tableSize);
+    }
+}
+
+std::size_t IntegralImage::tablesSize(imgsize_t channelWidth, imgsize_t channelHeight)
+{
+    std::size_t tableSize = (std::size_t(channelWidth) + 1) * (std::size_t(channelHeight) + 1);
+    std::size_t tiles = std::size_t((channelWidth + tile - 1) / tile) * ((channelHeight + tile - 1) / tile);
+    return 4 * (2 * tableSize + (tiles * 2 * sizeof(bitdepth_t) + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+}
+
+IntegralImage::ptr IntegralImage::build(const RawImage& raw)
+{
+    imgsize_t width = raw.bayerWidth() / 2;
+    imgsize_t height = raw.bayerHeight() / 2;
+    std::shared_ptr<uint64_t> memory(new uint64_t[tablesSize(width, height)], std::default_delete<uint64_t[]>());
+    std::shared_ptr<IntegralImage> index(new IntegralImage(width, height, memory.get(), memory));
+
+    Parallel::run(4, [&](std::size_t c) // a channel per task
+    {
+        std::size_t stride = std::size_t(width) + 1;
+        uint64_t* sum = index->sum[c];
+        uint64_t* sum2 = index->sum2[c];
+        bitdepth_t* range = index->range[c];
+        std::fill(sum, sum + stride, 0);
+        std::fill(sum2, sum2 + stride, 0);
+        for (std::size_t t = 0; t < std::size_t(index->tilesX) * index->tilesY; t++)
+        {
+            range[2 * t] = std::numeric_limits<bitdepth_t>::max();
+            range[2 * t + 1] = std::numeric_limits<bitdepth_t>::min();
+        }
+        if (!width) return;
+
+        auto plane = position(raw, c)->select();
+        std::vector<bitdepth_t> buffer;
+        for (imgsize_t qy = 0; qy < height; qy++)
+        {
+            ImageSelection::Span span = plane->row(qy, buffer);
+            const uint64_t* above = sum + qy * stride;
+            const uint64_t* above2 = sum2 + qy * stride;
+            uint64_t* current = sum + (qy + 1) * stride;
+            uint64_t* current2 = sum2 + (qy + 1) * stride;
+            bitdepth_t* tiles = range + 2 * std::size_t(qy / tile) * index->tilesX;
+            uint64_t rowSum = 0, rowSum2 = 0;
+            current[0] = current2[0] = 0;
+            for (imgsize_t qx = 0; qx < width; qx++)
+            {
+                bitdepth_t dn = span.data[std::size_t(qx) * span.stride];
+                rowSum += dn;
+                rowSum2 += uint64_t(dn) * dn;
+                current[qx + 1] = above[qx + 1] + rowSum;
+                current2[qx + 1] = above2[qx + 1] + rowSum2;
+                bitdepth_t* minmax = tiles + 2 * (qx / tile);
+                if (dn < minmax[0]) minmax[0] = dn;
+                if (dn > minmax[1]) minmax[1] = dn;
+            }
+        }
+    });
+    return index;
+}
+
+IntegralImage::ptr IntegralImage::load(const std::string& fileName, const RawImage& raw, const std::string& imageFile)
+{
+    SidecarHeader expected = header(raw, imageFile);
+    if (!expected.imageSize) return ptr();
+    std::size_t words = tablesSize(expected.width, expected.height);
+    uint64_t fileSize = sizeof(SidecarHeader) + words * sizeof(uint64_t);
+    SidecarHeader found;
+    std::shared_ptr<void> memory;
+    uint64_t* tables = nullptr;
+
+#ifdef _WIN32
+    std::ifstream in(fileName.c_str(), std::ios::binary);
+    if (!in || !in.read((char *) &found, sizeof(found)) || std::memcmp(&found, &expected, sizeof(found))) return ptr();
+    std::shared_ptr<uint64_t> copy(new uint64_t[words], std::default_delete<uint64_t[]>());
+    if (!in.read((char *) copy.get(), std::streamsize(words * sizeof(uint64_t)))) return ptr();
+    memory = copy;
+    tables = copy.get();
+#else
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) return ptr();
+    struct stat fileInfo;
+    bool valid = !fstat(fd, &fileInfo) && (uint64_t(fileInfo.st_size) == fileSize)
+              && (read(fd, &found, sizeof(found)) == ssize_t(sizeof(found))) && !std::memcmp(&found, &expected, sizeof(found));
+    void* address = valid? mmap(nullptr, std::size_t(fileSize), PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (address == MAP_FAILED) return ptr();
+    memory = std::shared_ptr<void>(address, [fileSize](void* mapped) { munmap(mapped, std::size_t(fileSize)); });
+    tables = reinterpret_cast<uint64_t*>(static_cast<uint8_t*>(address) + sizeof(SidecarHeader)); // read only
+#endif
+
+    return ptr(new IntegralImage(expected.width, expected.height, tables, memory));
+}
+
+void IntegralImage::save(const std::string& fileName, const RawImage& raw, const std::string& imageFile) const
+{
+    SidecarHeader info = header(raw, imageFile);
+    if (!info.imageSize) return;
+    std::string temporary = fileName + ".tmp"; // concurrent readers never see a partial file
+    {
+        std::ofstream out(temporary.c_str(), std::ios::binary);
+        bool written = out.write((const char*) &info, sizeof(info))
+                    && out.write((const char*) sum[0], std::streamsize(tablesSize(width, height) * sizeof(uint64_t)));
+        out.close();
+        if (!written || out.fail())
+        {
+            std::remove(temporary.c_str());
+            return;
+        }
+    }
+#ifdef _WIN32
+    std::remove(fileName.c_str());
+#endif
+    if (std::rename(temporary.c_str(), fileName.c_str())) std::remove(temporary.c_str());
+}
+
+PixelKernels::Sums IntegralImage::sums(const ImageSelection& area, std::size_t channel, bool minmax,
+                                       int64_t qx0, int64_t qy0, int64_t qx1, int64_t qy1) const
+{
+    PixelKernels::Sums result;
+    if ((qx0 >= qx1) || (qy0 >= qy1)) return result;
+
+    std::size_t columns = std::size_t(width) + 1;
+    auto corners = [&](const uint64_t* table) // modular arithmetic: exact whenever the true result fits
+    {
+        return table[std::size_t(qy1) * columns + std::size_t(qx1)] - table[std::size_t(qy0) * columns + std::size_t(qx1)]
+             - table[std::size_t(qy1) * columns + std::size_t(qx0)] + table[std::size_t(qy0) * columns + std::size_t(qx0)];
+    };
+    result.count = uint64_t(qx1 - qx0) * uint64_t(qy1 - qy0);
+    result.sum = corners(sum[channel]);
+    result.sum2 = corners(sum2[channel]);
+    if (!minmax) return result;
+
+    auto plane = position(*area.channel->raw, channel);
+    auto scan = [&](int64_t x0, int64_t y0, int64_t x1, int64_t y1) // min & max of pixels not covered by whole tiles
+    {
+        if ((x0 >= x1) || (y0 >= y1)) return;
+        PixelKernels::Sums border;
+        plane->select(imgsize_t(x0), imgsize_t(y0), imgsize_t(x1 - x0), imgsize_t(y1 - y0))->forEachRow(
+                [&border](const bitdepth_t* pixel, imgsize_t stride, imgsize_t count)
+        {
+            PixelKernels::accumulate(pixel, stride, count, border);
+        });
+        if (border.min < result.min) result.min = border.min;
+        if (border.max > result.max) result.max = border.max;
+    };
+
+    int64_t tx0 = (qx0 + tile - 1) / tile, tx1 = qx1 / tile; // tiles fully inside
+    int64_t ty0 = (qy0 + tile - 1) / tile, ty1 = qy1 / tile;
+    if ((tx0 >= tx1) || (ty0 >= ty1)) scan(qx0, qy0, qx1, qy1);
+    else
+    {
+        for (int64_t ty = ty0; ty < ty1; ty++)
+        {
+            const bitdepth_t* tileRange = range[channel] + 2 * (std::size_t(ty) * tilesX + std::size_t(tx0));
+            for (int64_t tx = tx0; tx < tx1; tx++, tileRange += 2)
+            {
+                if (tileRange[0] < result.min) result.min = tileRange[0];
+                if (tileRange[1] > result.max) result.max = tileRange[1];
+            }
+        }
+        scan(qx0, qy0, qx1, ty0 * tile); // top
+        scan(qx0, ty1 * tile, qx1, qy1); // bottom
+        scan(qx0, ty0 * tile, tx0 * tile, ty1 * tile); // left
+        scan(tx1 * tile, ty0 * tile, qx1, ty1 * tile); // right
+    }
+    return result;
+}
+
+template <typename RectFunction> static void forEachChannel(const ImageSelection& area, RectFunction rectFunction)
+{
+    auto ceilHalf = [](int64_t value) { return (value + 1) >> 1; }; // also for negative values
+    const ImageFilter& filter = area.channel->filter;
+    int64_t x0 = area.x, y0 = area.y, x1 = int64_t(area.x) + area.width, y1 = int64_t(area.y) + area.height;
+    for (std::size_t c = 0; c < 4; c++) // area pixels of each quad position: [x0, x1) x [y0, y1) in its own coordinates
+    {
+        int64_t xshift = ImageFilter::quad[c].xshift_e;
+        int64_t yshift = ImageFilter::quad[c].yshift;
+        if (filter.code == ImageFilter::Code::RGB)
+            rectFunction(c, ceilHalf(x0 - xshift), ceilHalf(y0 - yshift), ceilHalf(x1 - xshift), ceilHalf(y1 - yshift));
+        else if (filter.ydelta == 1) // G: the greens of the even rows, then the ones of the odd rows
+        {
+            if (imgsize_t(xshift) == (yshift? filter.xshift_o : filter.xshift_e))
+                rectFunction(c, x0, ceilHalf(y0 - yshift), x1, ceilHalf(y1 - yshift));
+        }
+        else if ((imgsize_t(xshift) == filter.xshift_e) && (imgsize_t(yshift) == filter.yshift))
+            rectFunction(c, x0, y0, x1, y1);
+    }
+}
+
+bool IntegralImage::covers(const ImageSelection& area) const
+{
+    if ((area.channel->filter.xdelta > 2) || (area.channel->filter.ydelta > 2)) return false; // CFA period over 2x2
+    bool inside = true; // false if the selection includes an incomplete quad (odd sized image)
+    forEachChannel(area, [&](std::size_t, int64_t x0, int64_t y0, int64_t x1, int64_t y1)
+    {
+        if ((x1 > width) || (y1 > height)) inside = false;
+        // (64-bit tables: the sum of squares of a channel is exact below 2^32 pixels only)
+        if ((x1 > x0) && (y1 > y0) && (uint64_t(x1 - x0) * uint64_t(y1 - y0) >> 32)) inside = false;
+    });
+    return inside;
+}
+
+PixelKernels::Sums IntegralImage::sums(const ImageSelection& area, bool minmax) const
+{
+    if (!covers(area)) throw ImageException("selection not covered by the integral image");
+    PixelKernels::Sums result;
+    forEachChannel(area, [&](std::size_t c, int64_t x0, int64_t y0, int64_t x1, int64_t y1)
+    {
+        result.add(sums(area, c, minmax, x0, y0, x1, y1));
+    });
+    return result;
+}
@@ -0,0 +1,77 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INTEGRALIMAGE_H_
+#define INTEGRALIMAGE_H_
+
+#include <string>
+#include "PixelKernels.h"
+#include "ImageSelection.h"
+
+/* Summed-area tables (sum and sum of squares, 64-bit) of the four quad positions of a RawImage (the R, G1, G2 and B
+ * channels of RGGB) plus the min and max of every tile of 16x16 pixels: the statistics of any selection are answered
+ * without a full scan.
+ * Memory required: 16 bytes per pixel. The tables are a snapshot of the pixels when built.
+ */
+class IntegralImage
+{
+        IntegralImage& operator=(const IntegralImage&) = delete;
+        IntegralImage(const IntegralImage&) = delete;
+
+    public:
+
+        typedef std::shared_ptr<const IntegralImage> ptr;
+
+        static ptr build(const class RawImage& raw);
+
+        // sidecar file (tables saved along with the size and time of the image file): nullptr if missing or outdated
+        static ptr load(const std::string& fileName, const class RawImage& raw, const std::string& imageFile);
+
+        // silently skipped on failure (the sidecar is just a cache)
+        void save(const std::string& fileName, const class RawImage& raw, const std::string& imageFile) const;
+
+        bool covers(const ImageSelection& area) const; // false if including pixels of incomplete quads
+
+        /* Exact results (the same as scanning all the pixels): count, sum & sum of squares in constant time, min & max
+         * (unless not required) from the tiles fully inside the selection plus the remaining border pixels.
+         */
+        PixelKernels::Sums sums(const ImageSelection& area, bool minmax = true) const;
+
+    private:
+
+        static const imgsize_t tile = 16;
+
+        IntegralImage(imgsize_t channelWidth, imgsize_t channelHeight, uint64_t* tables, const std::shared_ptr<void>& storage);
+
+        static std::size_t tablesSize(imgsize_t channelWidth, imgsize_t channelHeight); // in 64-bit words
+
+        PixelKernels::Sums sums(const ImageSelection& area, std::size_t channel, bool minmax,
+                                int64_t qx0, int64_t qy0, int64_t qx1, int64_t qy1) const; // [qx0, qx1) x [qy0, qy1)
+
+        const imgsize_t width; // of each channel
+        const imgsize_t height;
+        const imgsize_t tilesX;
+        const imgsize_t tilesY;
+        const std::shared_ptr<void> storage; // memory or file mapping
+
+        uint64_t* sum[4];     // quad positions: (width + 1) x (height + 1) with a zero first row and column
+        uint64_t* sum2[4];
+        bitdepth_t* range[4]; // min and max of every tile
+};
+
+#endif /* INTEGRALIMAGE_H_ */
@@ -0,0 +1,172 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <system_error>
+#include "Parallel.h"
+
+static thread_local bool insideTask = false;
+
+class Pool
+{
+    public:
+
+        ~Pool() { resize(0); }
+
+        void resize(unsigned threads) // including the caller one
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& worker : workers) worker.join();
+            workers.clear();
+            stopping = false;
+            try
+            {
+                for (unsigned t = 1; t < threads; t++) workers.emplace_back(&Pool::worker, this);
+            }
+            catch (std::system_error&) {} // system limit reached: those already started will do the work
+            configured = true;
+        }
+
+        unsigned size()
+        {
+            if (!configured) resize(std::max(1u, std::thread::hardware_concurrency()));
+            return unsigned(workers.size() + 1);
+        }
+
+        void run(std::size_t tasks, const std::function<void(std::size_t)>& task)
+        {
+            std::unique_lock<std::mutex> busy(jobMutex, std::defer_lock);
+            if ((tasks < 2) || insideTask || (size() < 2) || !busy.try_lock())
+            {
+                for (std::size_t t = 0; t < tasks; t++) task(t); // nested or concurrent usage
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                job = &task;
+                jobTasks = tasks;
+                next = 0;
+                pending = tasks;
+                failure = nullptr;
+                generation++;
+            }
+            wake.notify_all();
+            work();
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [this] { return !pending && !active; });
+            job = nullptr;
+            if (failure) std::rethrow_exception(failure);
+        }
+
+    private:
+
+        void work()
+        {
+            insideTask = true;
+            for (std::size_t t = next++; t < jobTasks; t = next++)
+            {
+                try { (*job)(t); }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!failure) failure = std::current_exception();
+                }
+                if (--pending == 0)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    done.notify_all();
+                }
+            }
+            insideTask = false;
+        }
+
+        void worker()
+        {
+            unsigned long seen = 0;
+            for (;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [&] { return stopping || (generation != seen); });
+                    if (stopping) return;
+                    seen = generation;
+                    if (!pending) continue; // job already finished
+                    active++;
+                }
+                work();
+                std::lock_guard<std::mutex> lock(mutex);
+                active--;
+                done.notify_all();
+            }
+        }
+
+        std::vector<std::thread> workers;
+        bool configured = false;
+        bool stopping = false;
+
+        std::mutex jobMutex; // a single job at a time
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+
+        const std::function<void(std::size_t)>* job = nullptr;
+        std::size_t jobTasks = 0;
+        std::atomic<std::size_t> next { 0 };
+        std::atomic<std::size_t> pending { 0 };
+        unsigned active = 0;
+        unsigned long generation = 0;
+        std::exception_ptr failure;
+};
+
+static Pool& pool()
+{
+    static Pool instance;
+    return instance;
+}
+
+void Parallel::setThreads(unsigned count)
+{
+    pool().resize(count? count : std::max(1u, std::thread::hardware_concurrency()));
+}
+
+unsigned Parallel::threads()
+{
+    return pool().size();
+}
+
+std::vector<Parallel::Band> Parallel::split(imgsize_t width, imgsize_t height)
+{
+    const uint64_t bandPixels = 1 << 18; // big enough to make the scheduling overhead negligible
+    imgsize_t rows = imgsize_t(std::max(uint64_t(1), bandPixels / std::max(width, imgsize_t(1))));
+    std::vector<Band> bands;
+    for (imgsize_t y = 0; y < height; y += rows) bands.emplace_back(Band { y, std::min(rows, height - y) });
+    return bands;
+}
+
+void Parallel::run(std::size_t tasks, const std::function<void(std::size_t task)>& task)
+{
+    pool().run(tasks, task);
+}
@@ -0,0 +1,50 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <functional>
+#include <vector>
+#include "ImageSelection.h"
+
+/* Process-wide pool of worker threads. Work is split in horizontal bands whose layout only depends on the
+ * image geometry (never on the thread count) and the partial results are expected to be merged by the
+ * caller in band order, so the output is reproducible whatever the number of threads.
+ */
+struct Parallel
+{
+    struct Band
+    {
+        imgsize_t y;      // first row
+        imgsize_t height; // rows count
+    };
+
+    static void setThreads(unsigned count); // 0: as many as hardware threads (the default)
+
+    static unsigned threads();
+
+    static std::vector<Band> split(imgsize_t width, imgsize_t height); // bands of a width x height area
+
+    /* Runs task(0) ... task(tasks-1) using the pool plus the calling thread, returning when all of them are done
+     * (the first exception thrown by any task is rethrown). Nested calls (from a task) run sequentially.
+     */
+    static void run(std::size_t tasks, const std::function<void(std::size_t task)>& task);
+};
+
+#endif /* PARALLEL_H_ */
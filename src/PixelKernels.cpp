@@ -0,0 +1,723 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include "Cpu.hpp"
+#include "PixelKernels.h"
+
+/* The scalar loops are instantiated for the strides of the rows of every channel (1: RGB or planar, 2: Bayer) as
+ * compile time constants, so they get unrolled and vectorized; Stride 0 stands for any other (runtime) stride.
+ */
+template <imgsize_t Stride>
+static void accumulateStrided(const bitdepth_t* pixel, imgsize_t stride, imgsize_t count, PixelKernels::Sums& sums)
+{
+    const std::size_t step = Stride? Stride : stride;
+    bitdepth_t min = sums.min;
+    bitdepth_t max = sums.max;
+    uint64_t sum = 0;
+    uint64_t sum2 = 0;
+    for (imgsize_t px = 0; px < count; px++)
+    {
+        bitdepth_t dn = pixel[px * step];
+        if (dn < min) min = dn;
+        if (dn > max) max = dn;
+        sum += dn;
+        sum2 += uint64_t(dn) * dn;
+    }
+    sums.count += count;
+    sums.sum += sum;
+    sums.sum2 += sum2;
+    sums.min = min;
+    sums.max = max;
+}
+
+static void accumulateScalar(const bitdepth_t* pixel, imgsize_t stride, imgsize_t count, PixelKernels::Sums& sums)
+{
+    switch (stride)
+    {
+        case 1:  return accumulateStrided<1>(pixel, stride, count, sums);
+        case 2:  return accumulateStrided<2>(pixel, stride, count, sums);
+        default: return accumulateStrided<0>(pixel, stride, count, sums);
+    }
+}
+
+static void accumulatePairsScalar(const bitdepth_t* row, imgsize_t pairs,
+                                  PixelKernels::Sums& even, PixelKernels::Sums& odd)
+{
+    accumulateScalar(row, 2, pairs, even); // both walks over the same (L1 cached) data
+    accumulateScalar(row + 1, 2, pairs, odd);
+}
+
+template <imgsize_t Stride>
+static uint64_t dotStrided(const bitdepth_t* pixelA, imgsize_t strideA,
+                           const bitdepth_t* pixelB, imgsize_t strideB, imgsize_t count)
+{
+    const std::size_t stepA = Stride? Stride : strideA;
+    const std::size_t stepB = Stride? Stride : strideB;
+    uint64_t sum = 0;
+    for (imgsize_t px = 0; px < count; px++) sum += uint32_t(pixelA[px * stepA]) * pixelB[px * stepB]; // (exact in 32 bits)
+    return sum;
+}
+
+static uint64_t dotScalar(const bitdepth_t* pixelA, imgsize_t strideA,
+                          const bitdepth_t* pixelB, imgsize_t strideB, imgsize_t count)
+{
+    if (strideA != strideB) return dotStrided<0>(pixelA, strideA, pixelB, strideB, count);
+    switch (strideA)
+    {
+        case 1:  return dotStrided<1>(pixelA, strideA, pixelB, strideB, count);
+        case 2:  return dotStrided<2>(pixelA, strideA, pixelB, strideB, count);
+        default: return dotStrided<0>(pixelA, strideA, pixelB, strideB, count);
+    }
+}
+
+static void dotPairsScalar(const bitdepth_t* rowA, const bitdepth_t* rowB, imgsize_t pairs,
+                           PixelKernels::Wide& even, PixelKernels::Wide& odd)
+{
+    even += dotScalar(rowA, 2, rowB, 2, pairs);
+    odd += dotScalar(rowA + 1, 2, rowB + 1, 2, pairs);
+}
+
+static void addColumnsScalar(const bitdepth_t* row, imgsize_t count, uint32_t* sums)
+{
+    for (imgsize_t px = 0; px < count; px++) sums[px] += row[px];
+}
+
+static void mixQuadsScalar(const bitdepth_t* row0, const bitdepth_t* row1, imgsize_t quads, const uint32_t (&weights)[4],
+                           bitdepth_t black, bitdepth_t white, uint32_t* mix)
+{
+    for (imgsize_t q = 0; q < quads; q++)
+    {
+        const bitdepth_t sample[4] = { row0[2 * q], row0[2 * q + 1], row1[2 * q], row1[2 * q + 1] };
+        uint32_t sum = 0;
+        bool burnt = false;
+        for (std::size_t s = 0; s < 4; s++)
+        {
+            burnt |= sample[s] >= white;
+            sum += weights[s] * uint32_t(sample[s] > black? sample[s] - black : 0);
+        }
+        if (burnt) sum = PixelKernels::burnt;
+        mix[q] = sum;
+    }
+}
+
+static void dualPixelScalar(const PixelKernels::DualPixel& params, const bitdepth_t* const (&rowsAB)[2],
+                            const bitdepth_t* const (&rowsB)[2], bitdepth_t* const (&output)[2], imgsize_t pairs)
+{
+    for (std::size_t px = 0; px < 2 * std::size_t(pairs); px += 2)
+    {
+        bool burnt = false;
+        if (params.wholeQuads) for (std::size_t s = 0; s < 4; s++) burnt |= rowsAB[s / 2][px + s % 2] >= params.white;
+        for (std::size_t s = 0; s < 4; s++)
+        {
+            bitdepth_t ab = rowsAB[s / 2][px + s % 2];
+            bitdepth_t b = rowsB[s / 2][px + s % 2];
+            double value = params.getA? 0.5 + (ab - params.blackAB[s]) - (b - params.blackB[s]) + params.blackB[s]
+                                      : 0.5 + (ab - params.blackAB[s]) * params.scale + params.blackB[s];
+            bitdepth_t result = bitdepth_t(int32_t(value)); // (truncated to 32 bits first, as gcc does)
+            if (params.wholeQuads? burnt : ab >= params.white) result = params.getA && params.wholeQuads? params.white : b;
+            output[s / 2][px + s % 2] = result;
+        }
+    }
+}
+
+static void deinterleaveScalar(const uint8_t* row, imgsize_t pairs, bitdepth_t* even, bitdepth_t* odd, bool swap)
+{
+    for (imgsize_t px = 0; px < pairs; px++)
+    {
+        bitdepth_t pair[2];
+        std::memcpy(pair, row + px * sizeof(pair), sizeof(pair)); // unaligned-safe load
+        even[px] = swap? byteSwap(pair[0]) : pair[0];
+        odd[px] = swap? byteSwap(pair[1]) : pair[1];
+    }
+}
+
+static void unpack10Scalar(const uint8_t* packed, imgsize_t groups, bitdepth_t* pixels)
+{
+    for (imgsize_t g = 0; g < groups; g++, packed += 5, pixels += 4)
+        for (int px = 0; px < 4; px++) pixels[px] = bitdepth_t(packed[px] << 2 | ((packed[4] >> (2 * px)) & 3));
+}
+
+static void unpack12Scalar(const uint8_t* packed, imgsize_t groups, bitdepth_t* pixels)
+{
+    for (imgsize_t g = 0; g < groups; g++, packed += 3, pixels += 2)
+    {
+        pixels[0] = bitdepth_t(packed[0] << 4 | (packed[2] & 0x0F));
+        pixels[1] = bitdepth_t(packed[1] << 4 | packed[2] >> 4);
+    }
+}
+
+static void unpackWordsScalar(const uint8_t* words, imgsize_t count, bitdepth_t mask, bitdepth_t* pixels)
+{
+    for (imgsize_t px = 0; px < count; px++, words += 2) pixels[px] = bitdepth_t((words[0] | words[1] << 8) & mask);
+}
+
+#ifdef HRAW_X86_DISPATCH
+
+HRAW_TARGET("avx2")
+static void deinterleaveAVX2(const uint8_t* row, imgsize_t pairs, bitdepth_t* even, bitdepth_t* odd, bool swap)
+{
+    // inside each 128-bit lane gather the even samples in the low half and the odd ones in the high half
+    const __m256i order = swap? _mm256_setr_epi8(1, 0, 5, 4, 9, 8, 13, 12, 3, 2, 7, 6, 11, 10, 15, 14,
+                                                 1, 0, 5, 4, 9, 8, 13, 12, 3, 2, 7, 6, 11, 10, 15, 14)
+                              : _mm256_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15,
+                                                 0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15);
+    imgsize_t px = 0;
+    for (; px + 8 <= pairs; px += 8)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + 4 * px));
+        v = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(v, order), 0xD8); // evens (low) | odds (high)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(even + px), _mm256_castsi256_si128(v));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(odd + px), _mm256_extracti128_si256(v, 1));
+    }
+    deinterleaveScalar(row + 4 * px, pairs - px, even + px, odd + px, swap);
+}
+
+/* The packed formats are unpacked 8 pixels per 128-bit lane: each lane loads its own 16 bytes (only 10 or 12 of
+ * them used) so the byte shuffles never cross lanes; the loops stop while those loads are still within the input.
+ */
+HRAW_TARGET("avx2") static inline __m256i loadLanesAVX2(const uint8_t* low, const uint8_t* high)
+{
+    __m128i lane0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(low));
+    __m128i lane1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(high));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(lane0), lane1, 1);
+}
+
+HRAW_TARGET("avx2")
+static void unpack10AVX2(const uint8_t* packed, imgsize_t groups, bitdepth_t* pixels)
+{
+    const __m256i high = _mm256_setr_epi8(0, -1, 1, -1, 2, -1, 3, -1, 5, -1, 6, -1, 7, -1, 8, -1,
+                                          0, -1, 1, -1, 2, -1, 3, -1, 5, -1, 6, -1, 7, -1, 8, -1);
+    const __m256i low = _mm256_setr_epi8(4, -1, 4, -1, 4, -1, 4, -1, 9, -1, 9, -1, 9, -1, 9, -1,
+                                         4, -1, 4, -1, 4, -1, 4, -1, 9, -1, 9, -1, 9, -1, 9, -1);
+    const __m256i shift = _mm256_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1, 64, 16, 4, 1, 64, 16, 4, 1); // to bits 6-7
+    const __m256i three = _mm256_set1_epi16(3);
+    imgsize_t g = 0;
+    for (; g + 6 <= groups; g += 4) // 26 bytes read, 20 consumed
+    {
+        __m256i bytes = loadLanesAVX2(packed + g * 5, packed + g * 5 + 10);
+        __m256i msb = _mm256_slli_epi16(_mm256_shuffle_epi8(bytes, high), 2);
+        __m256i lsb = _mm256_and_si256(_mm256_srli_epi16(_mm256_mullo_epi16(_mm256_shuffle_epi8(bytes, low), shift), 6), three);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels + g * 4), _mm256_or_si256(msb, lsb));
+    }
+    unpack10Scalar(packed + g * 5, groups - g, pixels + g * 4);
+}
+
+HRAW_TARGET("avx2")
+static void unpack12AVX2(const uint8_t* packed, imgsize_t groups, bitdepth_t* pixels)
+{
+    const __m256i high = _mm256_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1,
+                                          0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1);
+    const __m256i low = _mm256_setr_epi8(2, -1, 2, -1, 5, -1, 5, -1, 8, -1, 8, -1, 11, -1, 11, -1,
+                                         2, -1, 2, -1, 5, -1, 5, -1, 8, -1, 8, -1, 11, -1, 11, -1);
+    const __m256i shift = _mm256_setr_epi16(16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1); // to bits 4-7
+    const __m256i nibble = _mm256_set1_epi16(0x0F);
+    imgsize_t g = 0;
+    for (; g + 10 <= groups; g += 8) // 28 bytes read, 24 consumed
+    {
+        __m256i bytes = loadLanesAVX2(packed + g * 3, packed + g * 3 + 12);
+        __m256i msb = _mm256_slli_epi16(_mm256_shuffle_epi8(bytes, high), 4);
+        __m256i lsb = _mm256_and_si256(_mm256_srli_epi16(_mm256_mullo_epi16(_mm256_shuffle_epi8(bytes, low), shift), 4), nibble);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels + g * 2), _mm256_or_si256(msb, lsb));
+    }
+    unpack12Scalar(packed + g * 3, groups - g, pixels + g * 2);
+}
+
+HRAW_TARGET("avx2")
+static void unpackWordsAVX2(const uint8_t* words, imgsize_t count, bitdepth_t mask, bitdepth_t* pixels)
+{
+    const __m256i bits = _mm256_set1_epi16(short(mask));
+    imgsize_t px = 0;
+    for (; px + 16 <= count; px += 16) // x86 is little endian: no byte swapping
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + px * 2));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels + px), _mm256_and_si256(v, bits));
+    }
+    unpackWordsScalar(words + px * 2, count - px, mask, pixels + px);
+}
+
+/* Sums are accumulated in 32-bit lanes flushed to 64-bit ones every 'flushEvery' vectors (16-bit samples
+ * can't overflow them before) while the squares (exact in 32 bits) are directly widened to 64-bit lanes.
+ * Pixels 2 samples apart (Bayer channels) are read as 32-bit lanes whose upper half is discarded.
+ */
+static const imgsize_t flushEvery = 16384;
+
+HRAW_TARGET("avx2") static inline __m256i squaresAVX2(__m256i v) // 8 x u32 -> 4 x u64 (pairs of squares)
+{
+    __m256i odd = _mm256_srli_epi64(v, 32);
+    return _mm256_add_epi64(_mm256_mul_epu32(v, v), _mm256_mul_epu32(odd, odd));
+}
+
+HRAW_TARGET("avx2") static inline __m256i productsAVX2(__m256i a, __m256i b) // 8 x u32 -> 4 x u64
+{
+    __m256i product = _mm256_mul_epu32(a, b);
+    return _mm256_add_epi64(product, _mm256_mul_epu32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32)));
+}
+
+HRAW_TARGET("avx2") static inline __m256i widenAVX2(__m256i v) // 8 x u32 -> 4 x u64 (pairs added)
+{
+    return _mm256_add_epi64(_mm256_cvtepu32_epi64(_mm256_castsi256_si128(v)),
+                            _mm256_cvtepu32_epi64(_mm256_extracti128_si256(v, 1)));
+}
+
+HRAW_TARGET("avx2") static inline uint64_t horizontalAVX2(__m256i v) // sum of 4 x u64
+{
+    __m128i pair = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return uint64_t(_mm_cvtsi128_si64(pair)) + uint64_t(_mm_extract_epi64(pair, 1));
+}
+
+HRAW_TARGET("avx2")
+static void accumulateAVX2(const bitdepth_t* pixel, imgsize_t stride, imgsize_t count, PixelKernels::Sums& sums)
+{
+    if ((stride > 2) || (count < 32)) return accumulateScalar(pixel, stride, count, sums);
+
+    imgsize_t vectors = stride == 1? count / 16 : (count - 1) / 8; // never reading beyond the last pixel
+    imgsize_t pixels = stride == 1? vectors * 16 : vectors * 8;
+    __m256i sum64 = _mm256_setzero_si256();
+    __m256i sq64 = _mm256_setzero_si256();
+    bitdepth_t min, max;
+
+    if (stride == 1)
+    {
+        __m256i vmin = _mm256_set1_epi16(short(sums.min));
+        __m256i vmax = _mm256_set1_epi16(short(sums.max));
+        for (imgsize_t done = 0; done < vectors;)
+        {
+            imgsize_t last = std::min(vectors, done + flushEvery);
+            __m256i sum32 = _mm256_setzero_si256();
+            for (; done < last; done++)
+            {
+                __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixel + std::size_t(done) * 16));
+                vmin = _mm256_min_epu16(vmin, v);
+                vmax = _mm256_max_epu16(vmax, v);
+                __m256i lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v));
+                __m256i hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1));
+                sum32 = _mm256_add_epi32(sum32, _mm256_add_epi32(lo, hi));
+                sq64 = _mm256_add_epi64(sq64, _mm256_add_epi64(squaresAVX2(lo), squaresAVX2(hi)));
+            }
+            sum64 = _mm256_add_epi64(sum64, widenAVX2(sum32));
+        }
+        __m128i lmin = _mm_min_epu16(_mm256_castsi256_si128(vmin), _mm256_extracti128_si256(vmin, 1));
+        __m128i lmax = _mm_max_epu16(_mm256_castsi256_si128(vmax), _mm256_extracti128_si256(vmax, 1));
+        min = bitdepth_t(_mm_cvtsi128_si32(_mm_minpos_epu16(lmin)));
+        max = bitdepth_t(~_mm_cvtsi128_si32(_mm_minpos_epu16(_mm_xor_si128(lmax, _mm_set1_epi32(-1)))));
+    }
+    else
+    {
+        const __m256i low16 = _mm256_set1_epi32(0xFFFF);
+        __m256i vmin = _mm256_set1_epi32(sums.min);
+        __m256i vmax = _mm256_set1_epi32(sums.max);
+        for (imgsize_t done = 0; done < vectors;)
+        {
+            imgsize_t last = std::min(vectors, done + flushEvery);
+            __m256i sum32 = _mm256_setzero_si256();
+            for (; done < last; done++)
+            {
+                __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixel + std::size_t(done) * 16));
+                v = _mm256_and_si256(v, low16);
+                vmin = _mm256_min_epu32(vmin, v);
+                vmax = _mm256_max_epu32(vmax, v);
+                sum32 = _mm256_add_epi32(sum32, v);
+                sq64 = _mm256_add_epi64(sq64, squaresAVX2(v));
+            }
+            sum64 = _mm256_add_epi64(sum64, widenAVX2(sum32));
+        }
+        __m128i lmin = _mm_min_epu32(_mm256_castsi256_si128(vmin), _mm256_extracti128_si256(vmin, 1));
+        __m128i lmax = _mm_max_epu32(_mm256_castsi256_si128(vmax), _mm256_extracti128_si256(vmax, 1));
+        lmin = _mm_min_epu32(lmin, _mm_shuffle_epi32(lmin, 0x4E));
+        lmax = _mm_max_epu32(lmax, _mm_shuffle_epi32(lmax, 0x4E));
+        min = bitdepth_t(_mm_cvtsi128_si32(_mm_min_epu32(lmin, _mm_shuffle_epi32(lmin, 0xB1))));
+        max = bitdepth_t(_mm_cvtsi128_si32(_mm_max_epu32(lmax, _mm_shuffle_epi32(lmax, 0xB1))));
+    }
+
+    sums.count += pixels;
+    sums.sum += horizontalAVX2(sum64);
+    sums.sum2 += horizontalAVX2(sq64);
+    sums.min = min;
+    sums.max = max;
+    accumulateScalar(pixel + std::size_t(pixels) * stride, stride, count - pixels, sums);
+}
+
+HRAW_TARGET("avx2") static inline void rangeAVX2(__m256i vmin, __m256i vmax, PixelKernels::Sums& sums) // of u32
+{
+    __m128i lmin = _mm_min_epu32(_mm256_castsi256_si128(vmin), _mm256_extracti128_si256(vmin, 1));
+    __m128i lmax = _mm_max_epu32(_mm256_castsi256_si128(vmax), _mm256_extracti128_si256(vmax, 1));
+    lmin = _mm_min_epu32(lmin, _mm_shuffle_epi32(lmin, 0x4E));
+    lmax = _mm_max_epu32(lmax, _mm_shuffle_epi32(lmax, 0x4E));
+    sums.min = bitdepth_t(_mm_cvtsi128_si32(_mm_min_epu32(lmin, _mm_shuffle_epi32(lmin, 0xB1))));
+    sums.max = bitdepth_t(_mm_cvtsi128_si32(_mm_max_epu32(lmax, _mm_shuffle_epi32(lmax, 0xB1))));
+}
+
+HRAW_TARGET("avx2")
+static void accumulatePairsAVX2(const bitdepth_t* row, imgsize_t pairs, PixelKernels::Sums& even, PixelKernels::Sums& odd)
+{
+    if (pairs < 16) return accumulatePairsScalar(row, pairs, even, odd);
+
+    imgsize_t vectors = pairs / 8;
+    const __m256i low16 = _mm256_set1_epi32(0xFFFF);
+    __m256i evenMin = _mm256_set1_epi32(even.min), evenMax = _mm256_set1_epi32(even.max);
+    __m256i oddMin = _mm256_set1_epi32(odd.min), oddMax = _mm256_set1_epi32(odd.max);
+    __m256i evenSum64 = _mm256_setzero_si256(), evenSq64 = _mm256_setzero_si256();
+    __m256i oddSum64 = _mm256_setzero_si256(), oddSq64 = _mm256_setzero_si256();
+    for (imgsize_t done = 0; done < vectors;)
+    {
+        imgsize_t last = std::min(vectors, done + flushEvery);
+        __m256i evenSum32 = _mm256_setzero_si256();
+        __m256i oddSum32 = _mm256_setzero_si256();
+        for (; done < last; done++)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + std::size_t(done) * 16));
+            __m256i e = _mm256_and_si256(v, low16); // even samples (little endian low halves)
+            __m256i o = _mm256_srli_epi32(v, 16);
+            evenMin = _mm256_min_epu32(evenMin, e);
+            evenMax = _mm256_max_epu32(evenMax, e);
+            oddMin = _mm256_min_epu32(oddMin, o);
+            oddMax = _mm256_max_epu32(oddMax, o);
+            evenSum32 = _mm256_add_epi32(evenSum32, e);
+            oddSum32 = _mm256_add_epi32(oddSum32, o);
+            evenSq64 = _mm256_add_epi64(evenSq64, squaresAVX2(e));
+            oddSq64 = _mm256_add_epi64(oddSq64, squaresAVX2(o));
+        }
+        evenSum64 = _mm256_add_epi64(evenSum64, widenAVX2(evenSum32));
+        oddSum64 = _mm256_add_epi64(oddSum64, widenAVX2(oddSum32));
+    }
+    rangeAVX2(evenMin, evenMax, even);
+    rangeAVX2(oddMin, oddMax, odd);
+    even.count += vectors * 8;
+    even.sum += horizontalAVX2(evenSum64);
+    even.sum2 += horizontalAVX2(evenSq64);
+    odd.count += vectors * 8;
+    odd.sum += horizontalAVX2(oddSum64);
+    odd.sum2 += horizontalAVX2(oddSq64);
+    accumulatePairsScalar(row + std::size_t(vectors) * 16, pairs - vectors * 8, even, odd);
+}
+
+HRAW_TARGET("avx512f,avx512bw") static inline __m512i squaresAVX512(__m512i v) // 16 x u32 -> 8 x u64
+{
+    __m512i odd = _mm512_srli_epi64(v, 32);
+    return _mm512_add_epi64(_mm512_mul_epu32(v, v), _mm512_mul_epu32(odd, odd));
+}
+
+HRAW_TARGET("avx512f,avx512bw") static inline __m512i widenAVX512(__m512i v) // 16 x u32 -> 8 x u64
+{
+    return _mm512_add_epi64(_mm512_cvtepu32_epi64(_mm512_castsi512_si256(v)),
+                            _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(v, 1)));
+}
+
+HRAW_TARGET("avx512f,avx512bw")
+static void accumulateAVX512(const bitdepth_t* pixel, imgsize_t stride, imgsize_t count, PixelKernels::Sums& sums)
+{
+    if ((stride > 2) || (count < 64)) return accumulateAVX2(pixel, stride, count, sums);
+
+    imgsize_t vectors = stride == 1? count / 32 : (count - 1) / 16; // never reading beyond the last pixel
+    imgsize_t pixels = stride == 1? vectors * 32 : vectors * 16;
+    __m512i sum64 = _mm512_setzero_si512();
+    __m512i sq64 = _mm512_setzero_si512();
+    bitdepth_t min, max;
+
+    if (stride == 1)
+    {
+        __m512i vmin = _mm512_set1_epi16(short(sums.min));
+        __m512i vmax = _mm512_set1_epi16(short(sums.max));
+        for (imgsize_t done = 0; done < vectors;)
+        {
+            imgsize_t last = std::min(vectors, done + flushEvery);
+            __m512i sum32 = _mm512_setzero_si512();
+            for (; done < last; done++)
+            {
+                __m512i v = _mm512_loadu_si512(pixel + std::size_t(done) * 32);
+                vmin = _mm512_min_epu16(vmin, v);
+                vmax = _mm512_max_epu16(vmax, v);
+                __m512i lo = _mm512_cvtepu16_epi32(_mm512_castsi512_si256(v));
+                __m512i hi = _mm512_cvtepu16_epi32(_mm512_extracti64x4_epi64(v, 1));
+                sum32 = _mm512_add_epi32(sum32, _mm512_add_epi32(lo, hi));
+                sq64 = _mm512_add_epi64(sq64, _mm512_add_epi64(squaresAVX512(lo), squaresAVX512(hi)));
+            }
+            sum64 = _mm512_add_epi64(sum64, widenAVX512(sum32));
+        }
+        __m256i hmin = _mm256_min_epu16(_mm512_castsi512_si256(vmin), _mm512_extracti64x4_epi64(vmin, 1));
+        __m256i hmax = _mm256_max_epu16(_mm512_castsi512_si256(vmax), _mm512_extracti64x4_epi64(vmax, 1));
+        __m128i lmin = _mm_min_epu16(_mm256_castsi256_si128(hmin), _mm256_extracti128_si256(hmin, 1));
+        __m128i lmax = _mm_max_epu16(_mm256_castsi256_si128(hmax), _mm256_extracti128_si256(hmax, 1));
+        min = bitdepth_t(_mm_cvtsi128_si32(_mm_minpos_epu16(lmin)));
+        max = bitdepth_t(~_mm_cvtsi128_si32(_mm_minpos_epu16(_mm_xor_si128(lmax, _mm_set1_epi32(-1)))));
+    }
+    else
+    {
+        const __m512i low16 = _mm512_set1_epi32(0xFFFF);
+        __m512i vmin = _mm512_set1_epi32(sums.min);
+        __m512i vmax = _mm512_set1_epi32(sums.max);
+        for (imgsize_t done = 0; done < vectors;)
+        {
+            imgsize_t last = std::min(vectors, done + flushEvery);
+            __m512i sum32 = _mm512_setzero_si512();
+            for (; done < last; done++)
+            {
+                __m512i v = _mm512_and_si512(_mm512_loadu_si512(pixel + std::size_t(done) * 32), low16);
+                vmin = _mm512_min_epu32(vmin, v);
+                vmax = _mm512_max_epu32(vmax, v);
+                sum32 = _mm512_add_epi32(sum32, v);
+                sq64 = _mm512_add_epi64(sq64, squaresAVX512(v));
+            }
+            sum64 = _mm512_add_epi64(sum64, widenAVX512(sum32));
+        }
+        min = bitdepth_t(_mm512_reduce_min_epu32(vmin));
+        max = bitdepth_t(_mm512_reduce_max_epu32(vmax));
+    }
+
+    sums.count += pixels;
+    sums.sum += uint64_t(_mm512_reduce_add_epi64(sum64));
+    sums.sum2 += uint64_t(_mm512_reduce_add_epi64(sq64));
+    sums.min = min;
+    sums.max = max;
+    accumulateScalar(pixel + std::size_t(pixels) * stride, stride, count - pixels, sums);
+}
+
+HRAW_TARGET("avx2") static uint64_t dotAVX2(const bitdepth_t* pixelA, imgsize_t strideA,
+                                            const bitdepth_t* pixelB, imgsize_t strideB, imgsize_t count)
+{
+    if ((strideA != strideB) || (strideA > 2) || (count < 32)) return dotScalar(pixelA, strideA, pixelB, strideB, count);
+
+    imgsize_t vectors = strideA == 1? count / 16 : (count - 1) / 8;
+    imgsize_t pixels = strideA == 1? vectors * 16 : vectors * 8;
+    const __m256i low16 = _mm256_set1_epi32(0xFFFF);
+    __m256i sum64 = _mm256_setzero_si256();
+    for (imgsize_t done = 0; done < vectors; done++)
+    {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixelA + std::size_t(done) * 16));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixelB + std::size_t(done) * 16));
+        if (strideA == 1)
+        {
+            sum64 = _mm256_add_epi64(sum64, productsAVX2(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(a)),
+                                                         _mm256_cvtepu16_epi32(_mm256_castsi256_si128(b))));
+            sum64 = _mm256_add_epi64(sum64, productsAVX2(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(a, 1)),
+                                                         _mm256_cvtepu16_epi32(_mm256_extracti128_si256(b, 1))));
+        }
+        else sum64 = _mm256_add_epi64(sum64, productsAVX2(_mm256_and_si256(a, low16), _mm256_and_si256(b, low16)));
+    }
+    return horizontalAVX2(sum64) + dotScalar(pixelA + std::size_t(pixels) * strideA, strideA,
+                                             pixelB + std::size_t(pixels) * strideB, strideB, count - pixels);
+}
+
+HRAW_TARGET("avx2")
+static void dotPairsAVX2(const bitdepth_t* rowA, const bitdepth_t* rowB, imgsize_t pairs,
+                         PixelKernels::Wide& even, PixelKernels::Wide& odd)
+{
+    imgsize_t vectors = pairs / 8;
+    const __m256i low16 = _mm256_set1_epi32(0xFFFF);
+    __m256i evenSum64 = _mm256_setzero_si256();
+    __m256i oddSum64 = _mm256_setzero_si256();
+    for (imgsize_t done = 0; done < vectors; done++)
+    {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rowA + std::size_t(done) * 16));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rowB + std::size_t(done) * 16));
+        evenSum64 = _mm256_add_epi64(evenSum64, productsAVX2(_mm256_and_si256(a, low16), _mm256_and_si256(b, low16)));
+        oddSum64 = _mm256_add_epi64(oddSum64, productsAVX2(_mm256_srli_epi32(a, 16), _mm256_srli_epi32(b, 16)));
+    }
+    even += horizontalAVX2(evenSum64);
+    odd += horizontalAVX2(oddSum64);
+    dotPairsScalar(rowA + std::size_t(vectors) * 16, rowB + std::size_t(vectors) * 16, pairs - vectors * 8, even, odd);
+}
+
+HRAW_TARGET("avx2")
+static void addColumnsAVX2(const bitdepth_t* row, imgsize_t count, uint32_t* sums)
+{
+    imgsize_t px = 0;
+    for (; px + 16 <= count; px += 16) // 16 pixels widened to two vectors of 32-bit lanes (vertical adds only)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + px));
+        __m256i* low = reinterpret_cast<__m256i*>(sums + px);
+        __m256i* high = reinterpret_cast<__m256i*>(sums + px + 8);
+        _mm256_storeu_si256(low, _mm256_add_epi32(_mm256_loadu_si256(low), _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v))));
+        _mm256_storeu_si256(high, _mm256_add_epi32(_mm256_loadu_si256(high), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1))));
+    }
+    addColumnsScalar(row + px, count - px, sums + px);
+}
+
+HRAW_TARGET("avx2")
+static void mixQuadsAVX2(const bitdepth_t* row0, const bitdepth_t* row1, imgsize_t quads, const uint32_t (&weights)[4],
+                         bitdepth_t black, bitdepth_t white, uint32_t* mix)
+{
+    const __m256i low16 = _mm256_set1_epi32(0xFFFF);
+    const __m256i vblack = _mm256_set1_epi16(short(black));
+    const __m256i vwhite = _mm256_set1_epi16(short(white));
+    const __m256i w0 = _mm256_set1_epi32(int(weights[0])), w1 = _mm256_set1_epi32(int(weights[1]));
+    const __m256i w2 = _mm256_set1_epi32(int(weights[2])), w3 = _mm256_set1_epi32(int(weights[3]));
+    imgsize_t q = 0;
+    for (; q + 8 <= quads; q += 8) // quads as 32-bit lanes (even sample in the low half)
+    {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row0 + 2 * std::size_t(q)));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row1 + 2 * std::size_t(q)));
+        __m256i burnt = _mm256_or_si256(_mm256_cmpeq_epi16(_mm256_max_epu16(a, vwhite), a),
+                                        _mm256_cmpeq_epi16(_mm256_max_epu16(b, vwhite), b));
+        burnt = _mm256_xor_si256(_mm256_cmpeq_epi32(burnt, _mm256_setzero_si256()), _mm256_set1_epi32(-1));
+        a = _mm256_subs_epu16(a, vblack);
+        b = _mm256_subs_epu16(b, vblack);
+        __m256i sum = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(a, low16), w0),
+                                       _mm256_mullo_epi32(_mm256_srli_epi32(a, 16), w1));
+        sum = _mm256_add_epi32(sum, _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(b, low16), w2),
+                                                     _mm256_mullo_epi32(_mm256_srli_epi32(b, 16), w3)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(mix + q), _mm256_or_si256(sum, burnt));
+    }
+    mixQuadsScalar(row0 + 2 * std::size_t(q), row1 + 2 * std::size_t(q), quads - q, weights, black, white, mix + q);
+}
+
+HRAW_TARGET("avx2")
+static void dualPixelAVX2(const PixelKernels::DualPixel& params, const bitdepth_t* const (&rowsAB)[2],
+                          const bitdepth_t* const (&rowsB)[2], bitdepth_t* const (&output)[2], imgsize_t pairs)
+{
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d scale = _mm256_set1_pd(params.scale);
+    const __m256d blackAB[2] = { _mm256_setr_pd(params.blackAB[0], params.blackAB[1], params.blackAB[0], params.blackAB[1]),
+                                 _mm256_setr_pd(params.blackAB[2], params.blackAB[3], params.blackAB[2], params.blackAB[3]) };
+    const __m256d blackB[2] = { _mm256_setr_pd(params.blackB[0], params.blackB[1], params.blackB[0], params.blackB[1]),
+                                _mm256_setr_pd(params.blackB[2], params.blackB[3], params.blackB[2], params.blackB[3]) };
+    const __m128i belowWhite = _mm_set1_epi32(int(params.white) - 1);
+    const __m128i white = _mm_set1_epi32(params.white);
+    const __m128i low16 = _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1);
+    bool whiteQuads = params.getA && params.wholeQuads;
+
+    imgsize_t q = 0;
+    for (; q + 2 <= pairs; q += 2) // two quads (4 samples of each row as 32-bit integers or doubles)
+    {
+        __m128i ab[2], b[2], burnt[2];
+        for (std::size_t r = 0; r < 2; r++)
+        {
+            ab[r] = _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(rowsAB[r] + 2 * std::size_t(q))));
+            b[r] = _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(rowsB[r] + 2 * std::size_t(q))));
+            burnt[r] = _mm_cmpgt_epi32(ab[r], belowWhite);
+        }
+        if (params.wholeQuads) // blend mask of the whole quad
+        {
+            __m128i any = _mm_or_si128(burnt[0], burnt[1]);
+            burnt[0] = burnt[1] = _mm_or_si128(any, _mm_shuffle_epi32(any, 0xB1));
+        }
+        for (std::size_t r = 0; r < 2; r++)
+        {
+            __m256d valueAB = _mm256_sub_pd(_mm256_cvtepi32_pd(ab[r]), blackAB[r]);
+            __m256d value = params.getA? _mm256_add_pd(_mm256_sub_pd(_mm256_add_pd(half, valueAB),
+                                                                     _mm256_sub_pd(_mm256_cvtepi32_pd(b[r]), blackB[r])), blackB[r])
+                                       : _mm256_add_pd(_mm256_add_pd(half, _mm256_mul_pd(valueAB, scale)), blackB[r]);
+            __m128i result = _mm_blendv_epi8(_mm256_cvttpd_epi32(value), whiteQuads? white : b[r], burnt[r]);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(output[r] + 2 * std::size_t(q)), _mm_shuffle_epi8(result, low16));
+        }
+    }
+    std::size_t done = 2 * std::size_t(q);
+    dualPixelScalar(params, { rowsAB[0] + done, rowsAB[1] + done }, { rowsB[0] + done, rowsB[1] + done },
+                    { output[0] + done, output[1] + done }, pairs - q);
+}
+
+#endif
+
+void PixelKernels::accumulate(const bitdepth_t* pixel, imgsize_t stride, imgsize_t count, Sums& sums)
+{
+#ifdef HRAW_X86_DISPATCH
+    switch (Cpu::simd())
+    {
+        case Cpu::Simd::AVX512: return accumulateAVX512(pixel, stride, count, sums);
+        case Cpu::Simd::AVX2:   return accumulateAVX2(pixel, stride, count, sums);
+        default:                break;
+    }
+#endif
+    accumulateScalar(pixel, stride, count, sums);
+}
+
+void PixelKernels::accumulatePairs(const bitdepth_t* row, imgsize_t pairs, Sums& even, Sums& odd)
+{
+#ifdef HRAW_X86_DISPATCH
+    if (Cpu::simd() >= Cpu::Simd::AVX2) return accumulatePairsAVX2(row, pairs, even, odd);
+#endif
+    accumulatePairsScalar(row, pairs, even, odd);
+}
+
+uint64_t PixelKernels::dot(const bitdepth_t* pixelA, imgsize_t strideA,
+                           const bitdepth_t* pixelB, imgsize_t strideB, imgsize_t count)
+{
+#ifdef HRAW_X86_DISPATCH
+    if (Cpu::simd() >= Cpu::Simd::AVX2) return dotAVX2(pixelA, strideA, pixelB, strideB, count);
+#endif
+    return dotScalar(pixelA, strideA, pixelB, strideB, count);
+}
+
+void PixelKernels::dotPairs(const bitdepth_t* rowA, const bitdepth_t* rowB, imgsize_t pairs, Wide& even, Wide& odd)
+{
+#ifdef HRAW_X86_DISPATCH
+    if (Cpu::simd() >= Cpu::Simd::AVX2) return dotPairsAVX2(rowA, rowB, pairs, even, odd);
+#endif
+    dotPairsScalar(rowA, rowB, pairs, even, odd);
+}
+
+void PixelKernels::addColumns(const bitdepth_t* row, imgsize_t count, uint32_t* sums)
+{
+#ifdef HRAW_X86_DISPATCH
+    if (Cpu::simd() >= Cpu::Simd::AVX2) return addColumnsAVX2(row, count, sums);
+#endif
+    addColumnsScalar(row, count, sums);
+}
+
+void PixelKernels::mixQuads(const bitdepth_t* row0, const bitdepth_t* row1, imgsize_t quads, const uint32_t (&weights)[4],
+                            bitdepth_t black, bitdepth_t white, uint32_t* mix)
+{
+#ifdef HRAW_X86_DISPATCH
+    if (Cpu::simd() >= Cpu::Simd::AVX2) return mixQuadsAVX2(row0, row1, quads, weights, black, white, mix);
+#endif
+    mixQuadsScalar(row0, row1, quads, weights, black, white, mix);
+}
+
+void PixelKernels::dualPixel(const DualPixel& params, const bitdepth_t* const (&rowsAB)[2], const bitdepth_t* const (&rowsB)[2],
+                             bitdepth_t* const (&output)[2], imgsize_t pairs)
+{
+#ifdef HRAW_X86_DISPATCH
+    if (Cpu::simd() >= Cpu::Simd::AVX2) return dualPixelAVX2(params, rowsAB, rowsB, output, pairs);
+#endif
+    dualPixelScalar(params, rowsAB, rowsB, output, pairs);
+}
+
+void PixelKernels::deinterleave(const void* row, imgsize_t pairs, bitdepth_t* even, bitdepth_t* odd, bool swap)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(row);
+#ifdef HRAW_X86_DISPATCH
+    if (Cpu::simd() >= Cpu::Simd::AVX2) return deinterleaveAVX2(bytes, pairs, even, odd, swap);
+#endif
+    deinterleaveScalar(bytes, pairs, even, odd, swap);
+}
+
+void PixelKernels::unpack10(const uint8_t* packed, imgsize_t groups, bitdepth_t* pixels)
+{
+#ifdef HRAW_X86_DISPATCH
+    if (Cpu::simd() >= Cpu::Simd::AVX2) return unpack10AVX2(packed, groups, pixels);
+#endif
+    unpack10Scalar(packed, groups, pixels);
+}
+
+void PixelKernels::unpack12(const uint8_t* packed, imgsize_t groups, bitdepth_t* pixels)
+{
+#ifdef HRAW_X86_DISPATCH
+    if (Cpu::simd() >= Cpu::Simd::AVX2) return unpack12AVX2(packed, groups, pixels);
+#endif
+    unpack12Scalar(packed, groups, pixels);
+}
+
+void PixelKernels::unpackWords(const uint8_t* words, imgsize_t count, bitdepth_t mask, bitdepth_t* pixels)
+{
+#ifdef HRAW_X86_DISPATCH
+    if (Cpu::simd() >= Cpu::Simd::AVX2) return unpackWordsAVX2(words, count, mask, pixels);
+#endif
+    unpackWordsScalar(words, count, mask, pixels);
+}
@@ -0,0 +1,150 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIXELKERNELS_H_
+#define PIXELKERNELS_H_
+
+#include <limits>
+#include "ImageSelection.h"
+
+struct PixelKernels // low level loops over raw memory (vectorized versions selected at runtime)
+{
+    struct Wide // unsigned 128-bit integer (sums of squares of any pixel count, the exact variance)
+    {
+        uint64_t high;
+        uint64_t low;
+
+        Wide(uint64_t value = 0) : high(0), low(value) {}
+        Wide(uint64_t highBits, uint64_t lowBits) : high(highBits), low(lowBits) {}
+
+        static Wide product(uint64_t a, uint64_t b)
+        {
+            uint64_t ll = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+            uint64_t lh = (a & 0xFFFFFFFF) * (b >> 32);
+            uint64_t hl = (a >> 32) * (b & 0xFFFFFFFF);
+            uint64_t middle = (ll >> 32) + (lh & 0xFFFFFFFF) + (hl & 0xFFFFFFFF);
+            return Wide((a >> 32) * (b >> 32) + (lh >> 32) + (hl >> 32) + (middle >> 32), (middle << 32) | (ll & 0xFFFFFFFF));
+        }
+
+        static Wide product(uint64_t a, const Wide& b) // (modulo 2^128)
+        {
+            Wide result = product(a, b.low);
+            result.high += a * b.high;
+            return result;
+        }
+
+        Wide& operator+=(const Wide& that)
+        {
+            low += that.low;
+            high += that.high + (low < that.low? 1 : 0);
+            return *this;
+        }
+
+        Wide& operator-=(const Wide& that)
+        {
+            high -= that.high + (low < that.low? 1 : 0);
+            low -= that.low;
+            return *this;
+        }
+
+        Wide operator+(const Wide& that) const { return Wide(*this) += that; }
+
+        Wide operator-(const Wide& that) const { return Wide(*this) -= that; }
+
+        double value() const { return double(high) * 18446744073709551616.0 + double(low); }
+    };
+
+    struct Sums // exact accumulators (no rounding at all for 16-bit samples below 2^48 pixels)
+    {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        Wide sum2;
+        bitdepth_t min = std::numeric_limits<bitdepth_t>::max();
+        bitdepth_t max = std::numeric_limits<bitdepth_t>::min();
+
+        void add(const Sums& that)
+        {
+            count += that.count;
+            sum += that.sum;
+            sum2 += that.sum2;
+            if (that.min < min) min = that.min;
+            if (that.max > max) max = that.max;
+        }
+
+        void remove(const Sums& that) // subset no longer included (min & max can't be updated)
+        {
+            count -= that.count;
+            sum -= that.sum;
+            sum2 -= that.sum2;
+        }
+    };
+
+    // single-pass min, max, sum and sum of squares of 'count' pixels 'stride' samples apart
+    static void accumulate(const bitdepth_t* pixel, imgsize_t stride, imgsize_t count, Sums& sums);
+
+    // accumulate() of the even and odd pixels of 'pairs' consecutive pixel pairs in a single pass
+    static void accumulatePairs(const bitdepth_t* row, imgsize_t pairs, Sums& even, Sums& odd);
+
+    // sum of the products of two pixel rows (allows computing the variance of their difference)
+    static uint64_t dot(const bitdepth_t* pixelA, imgsize_t strideA,
+                        const bitdepth_t* pixelB, imgsize_t strideB, imgsize_t count);
+
+    // dot() of the even and the odd pixels of two rows of 'pairs' consecutive pixel pairs in a single pass
+    static void dotPairs(const bitdepth_t* rowA, const bitdepth_t* rowB, imgsize_t pairs, Wide& even, Wide& odd);
+
+    // sums[i] += row[i] for 'count' consecutive pixels (32-bit sums: to be flushed before 65537 rows are added)
+    static void addColumns(const bitdepth_t* row, imgsize_t count, uint32_t* sums);
+
+    static const uint32_t burnt = 0xFFFFFFFF; // mixQuads() result of quads with any sample at the white level
+
+    /* Weighted sum of the four samples of 'quads' 2x2 quads given their two rows, each sample reduced by 'black'
+     * (clamped at zero) and weighted by weights[row * 2 + column]; 'burnt' if any of them is not below 'white'
+     */
+    static void mixQuads(const bitdepth_t* row0, const bitdepth_t* row1, imgsize_t quads, const uint32_t (&weights)[4],
+                         bitdepth_t black, bitdepth_t white, uint32_t* mix);
+
+    struct DualPixel // dual pixel raw processing (AB and B subframes) of the two rows of a band of 2x2 quads
+    {
+        bool getA;         // A = AB - B (otherwise AB scaled to match the B exposure)
+        bool wholeQuads;   // Bayer mode: a single sample of AB at the white level replaces its quad
+        bitdepth_t white;  // AB samples at or above it replaced by B (by white itself in the GetA Bayer mode)
+        double scale;
+        double blackAB[4]; // of the quad samples [row * 2 + column]
+        double blackB[4];
+    };
+
+    /* getA: 0.5 + (AB - blackAB) - (B - blackB) + blackB, otherwise 0.5 + (AB - blackAB) * scale + blackB
+     * (double precision converted to 16 bits as a plain C++ cast would do) for 'pairs' pixel pairs of both rows
+     */
+    static void dualPixel(const DualPixel& params, const bitdepth_t* const (&rowsAB)[2], const bitdepth_t* const (&rowsB)[2],
+                          bitdepth_t* const (&output)[2], imgsize_t pairs);
+
+    // MIPI CSI-2 RAW10: 'groups' groups of 5 bytes (the 8 high bits of 4 pixels, then their 2 low bits) to pixels
+    static void unpack10(const uint8_t* packed, imgsize_t groups, bitdepth_t* pixels);
+
+    // MIPI CSI-2 RAW12: 'groups' groups of 3 bytes (the 8 high bits of 2 pixels, then their 4 low bits) to pixels
+    static void unpack12(const uint8_t* packed, imgsize_t groups, bitdepth_t* pixels);
+
+    // 'count' little endian 16-bit words to pixels, keeping only the bits of 'mask'
+    static void unpackWords(const uint8_t* words, imgsize_t count, bitdepth_t mask, bitdepth_t* pixels);
+
+    // splits 'pairs' consecutive pixel pairs into two packed rows (optionally byte swapping them; 'row' may be unaligned)
+    static void deinterleave(const void* row, imgsize_t pairs, bitdepth_t* even, bitdepth_t* odd, bool swap);
+};
+
+#endif /* PIXELKERNELS_H_ */
@@ -0,0 +1,107 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Profile.h"
+
+std::atomic<bool> Profile::active(false);
+
+namespace
+{
+    struct Stage
+    {
+        std::string name;
+        uint64_t calls;
+        int64_t elapsedNs;
+        uint64_t pixels;
+        uint64_t bytes;
+    };
+
+    struct Measures
+    {
+        std::mutex mutex;
+        std::vector<Stage> stages; // a handful of them: linear search
+        int64_t started = 0;
+    };
+
+    Measures& measures()
+    {
+        static Measures instance;
+        return instance;
+    }
+}
+
+void Profile::start()
+{
+    Measures& all = measures();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    all.stages.clear();
+    all.started = Util::epochNs();
+    active = true;
+}
+
+void Profile::stop()
+{
+    active = false;
+}
+
+void Profile::record(const char* stage, int64_t elapsedNs, uint64_t pixels, uint64_t bytes)
+{
+    Measures& all = measures();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    for (auto& known : all.stages)
+        if (known.name == stage)
+        {
+            known.calls++;
+            known.elapsedNs += elapsedNs;
+            known.pixels += pixels;
+            known.bytes += bytes;
+            return;
+        }
+    all.stages.push_back(Stage { stage, 1, elapsedNs, pixels, bytes });
+}
+
+void Profile::report(std::ostream& out, const std::string& command, bool json)
+{
+    Measures& all = measures();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    double wall = double(Util::epochNs() - all.started) / 1e6;
+    auto throughput = [](uint64_t pixels, int64_t elapsedNs) { return elapsedNs > 0? double(pixels) * 1e3 / double(elapsedNs) : 0; };
+    if (json)
+    {
+        out << "{\"command\":\"" << command << "\",\"ms\":" << wall << ",\"stages\":[";
+        for (std::size_t s = 0; s < all.stages.size(); s++)
+        {
+            const Stage& stage = all.stages[s];
+            out << (s? "," : "") << "{\"stage\":\"" << stage.name << "\",\"calls\":" << stage.calls
+                << ",\"ms\":" << double(stage.elapsedNs) / 1e6 << ",\"bytes\":" << stage.bytes
+                << ",\"pixels\":" << stage.pixels << ",\"MPix/s\":" << throughput(stage.pixels, stage.elapsedNs) << "}";
+        }
+        out << "]}" << std::endl;
+    }
+    else
+    {
+        out << "stage;calls;ms;bytes;pixels;MPix/s" << std::endl;
+        for (const auto& stage : all.stages)
+            out << stage.name << ";" << stage.calls << ";" << double(stage.elapsedNs) / 1e6 << ";" << stage.bytes
+                << ";" << stage.pixels << ";" << throughput(stage.pixels, stage.elapsedNs) << std::endl;
+        out << command << ";1;" << wall << ";;;" << std::endl; // elapsed time of the whole command
+    }
+}
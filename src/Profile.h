@@ -0,0 +1,71 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include "Util.hpp"
+
+/* Wall time, pixels and bytes of every processing stage, accumulated by stage name while enabled (a relaxed load
+ * and a branch per stage otherwise). Stages running concurrently add their times up, so with several threads at
+ * work the sum of the stages may exceed the elapsed time of the command.
+ */
+struct Profile
+{
+    class Scope // a stage lasting the lifetime of the object
+    {
+        public:
+
+            explicit Scope(const char* stage, uint64_t pixels = 0, uint64_t bytes = 0)
+              : name(stage), pixelCount(pixels), byteCount(bytes), start(enabled()? Util::epochNs() : 0) {}
+
+            ~Scope() { if (start) record(name, Util::epochNs() - start, pixelCount, byteCount); }
+
+            void add(uint64_t pixels, uint64_t bytes) { pixelCount += pixels; byteCount += bytes; } // known later
+
+        private:
+
+            Scope& operator=(const Scope&) = delete;
+            Scope(const Scope&) = delete;
+
+            const char* const name;
+            uint64_t pixelCount;
+            uint64_t byteCount;
+            const int64_t start; // zero if not profiling
+    };
+
+    static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+    static void start(); // discards the previous measures
+
+    static void stop();
+
+    // the stages in the order they were first seen: a CSV like table or a JSON object
+    static void report(std::ostream& out, const std::string& command, bool json);
+
+    private:
+
+        static void record(const char* stage, int64_t elapsedNs, uint64_t pixels, uint64_t bytes);
+
+        static std::atomic<bool> active;
+};
+
+#endif /* PROFILE_H_ */
@@ -21,27 +21,21 @@
 #include <sstream>
 #include <fstream>
 #include <limits>
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <vector>
 #include "Util.hpp"
+#include "ByteOrder.h"
+#include "PixelKernels.h"
+#include "IntegralImage.h"
+#include "Profile.h"
 #include "RawImage.h"
 
-inline bool isBigEndian()
-{
-    static union { uint16_t i; uint8_t c; } endianness { 0x0102 };
-    return endianness.c == 0x01;
-}
-
-template <typename T> T endian(T n); // Winsock2.h would define conflicting macros like 'RGB' or (a lowercase!) 'max'...
-
-template <> uint16_t endian(uint16_t n)
-{
-    return isBigEndian()? n : uint16_t(n >> 8 | n << 8);
-}
-
-template <> uint32_t endian(uint32_t n)
-{
-    return isBigEndian()? n : uint32_t(n >> 24 | (n & 0xFF0000) >> 8 | (n & 0xFF00) << 8 | n << 24);
-}
-
 std::string getLastError() // no C++11 portable error reporting support actually beyond failbit
 {
     auto ecode = errno;
@@ -54,9 +48,8 @@ std::string getLastError() // no C++11 portable error reporting support actually
 #endif
 }
 
-RawImage::ptr loadPGM(const std::string& fileName,
-                      std::ifstream& in, std::istringstream& header,
-                      const RawImage::Masked& opticalBlack)
+RawImage::ptr RawImage::loadPGM(const std::string& fileName, std::istream& in, std::istream& header,
+                                const Masked& opticalBlack, Access access)
 {
     uint64_t ww, hh;
     header >> ww;
@@ -71,31 +64,140 @@ RawImage::ptr loadPGM(const std::string& fileName,
     if ((maxcolor < 256) || (maxcolor > 65535))
         throw ImageException(VA_STR(fileName << " not a 16-bit PGM file"));
 
-    auto image = RawImage::create(width, height, opticalBlack);
+    uint8_t delim;
+    header.read((char *) &delim, 1);
+
+    RawImage::ptr image;
+    if (access == Access::Map)
+    {
+        Profile::Scope stage("RawImage::load map");
+        image = mapPGM(fileName, uint64_t(std::streamoff(header.tellg())), width, height, opticalBlack);
+    }
+    else if (access == Access::Stream)
+    {
+        image = streamPGM(fileName, uint64_t(std::streamoff(header.tellg())), width, height, opticalBlack);
+    }
+
+    if (!image) // plain reading
+    {
+        image = RawImage::create(width, height, opticalBlack);
+
+        in.seekg(header.tellg(), std::ios::beg);
+
+        {
+            Profile::Scope stage("RawImage::load read", image->pixelCount(false), image->length);
+            if (!in.read((char *) image->data, std::streamsize(image->length)))
+                throw ImageException(VA_STR("error reading " << fileName));
+        }
+
+        if (!ByteOrder::isBigEndian())
+        {
+            Profile::Scope stage("RawImage::load byteswap", image->pixelCount(false), image->length);
+            ByteOrder::swap16(image->data, image->data, std::size_t(image->length / sizeof(bitdepth_t)));
+        }
+    }
 
     auto pd = fileName.find_last_of("\\/");
     image->name = fileName.substr((pd == std::string::npos)? 0 : pd + 1);
 
-    uint8_t delim;
-    header.read((char *) &delim, 1);
+    return image;
+}
 
-    in.seekg(header.tellg(), std::ios::beg);
+RawImage::ptr RawImage::mapPGM(const std::string& fileName, uint64_t offset,
+                               imgsize_t width, imgsize_t height, const Masked& opticalBlack)
+{
+#ifdef _WIN32
+    (void) fileName; (void) offset; (void) width; (void) height; (void) opticalBlack;
+    return RawImage::ptr(); // not supported (plain reading will be used instead)
+#else
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) throw ImageException(VA_STR("opening " << fileName << ": " << getLastError()));
 
-    if (!in.read((char *) image->data, image->length))
+    uint64_t mapSize = offset + uint64_t(sizeof(bitdepth_t)) * width * height;
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) || (uint64_t(fileInfo.st_size) < mapSize))
+    {
+        close(fd);
         throw ImageException(VA_STR("error reading " << fileName));
+    }
+
+    // private writable mapping: the pages of any pixels modified by the application become a copy
+    void* address = mmap(nullptr, std::size_t(mapSize), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) return RawImage::ptr();
+
+    std::shared_ptr<void> mapping(address, [mapSize](void* mapped) { munmap(mapped, std::size_t(mapSize)); });
+    // (an odd-sized header, like the "P5\n6000 4000\n65535\n" of dcraw, leaves them unaligned: see 'bytes')
+    uint8_t* pixels = static_cast<uint8_t*>(address) + offset;
+
+    return RawImage::ptr(new RawImage(width, height, opticalBlack, pixels, mapping, !ByteOrder::isBigEndian()));
+#endif
+}
+
+RawImage::ptr RawImage::streamPGM(const std::string& fileName, uint64_t offset,
+                                  imgsize_t width, imgsize_t height, const Masked& opticalBlack)
+{
+#ifdef _WIN32
+    (void) fileName; (void) offset; (void) width; (void) height; (void) opticalBlack;
+    return RawImage::ptr(); // not supported (plain reading will be used instead)
+#else
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) throw ImageException(VA_STR("opening " << fileName << ": " << getLastError()));
 
-    bitdepth_t* pixel = image->data;
-    for (imgsize_t px = 0; px < image->length; px++)
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) || (uint64_t(fileInfo.st_size) < offset + uint64_t(sizeof(bitdepth_t)) * width * height))
     {
-        *pixel = endian(*pixel);
-        pixel++;
+        close(fd);
+        throw ImageException(VA_STR("error reading " << fileName));
     }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL); // rows mostly read from top to bottom: larger read-ahead
+#endif
 
+    std::shared_ptr<Stream> stream(new Stream { fd, offset }, [](Stream* file) { close(file->descriptor); delete file; });
+    RawImage::ptr image(new RawImage(width, height, opticalBlack, nullptr, stream, !ByteOrder::isBigEndian()));
+    image->stream = stream;
     return image;
+#endif
+}
+
+void RawImage::read(uint64_t first, std::size_t samples, bitdepth_t* buffer) const
+{
+    if (origin) return origin->read(first, samples, buffer); // shared image
+    if (!stream) throw ImageException(VA_STR(name << ": not a streamed image"));
+#ifndef _WIN32
+    char* target = reinterpret_cast<char*>(buffer);
+    std::size_t remaining = samples * sizeof(bitdepth_t);
+    uint64_t position = stream->offset + first * sizeof(bitdepth_t);
+    while (remaining) // (pread is safe from several threads)
+    {
+        ssize_t done = pread(stream->descriptor, target, remaining, off_t(position));
+        if ((done < 0) && (errno == EINTR)) continue;
+        if (done <= 0) throw ImageException(VA_STR("error reading " << name << ": " << getLastError()));
+        target += done;
+        remaining -= std::size_t(done);
+        position += uint64_t(done);
+    }
+#endif
+}
+
+void RawImage::prefetch(const std::string& fileName)
+{
+#ifdef _WIN32
+    (void) fileName;
+#else
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) return; // the error will be reported when actually loading it
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED); // asynchronous read-ahead into the page cache
+#endif
+    close(fd);
+#endif
 }
 
-RawImage::ptr RawImage::load(const std::string& fileName, const Masked::ptr& opticalBlack) // from any supported file
+RawImage::ptr RawImage::load(const std::string& fileName, const Masked::ptr& opticalBlack, Access access) // any format
 {
+    Profile::Scope stage("RawImage::load");
     std::ifstream in(fileName.c_str(), std::ios::binary);
     if (!in) throw ImageException(VA_STR("opening " << fileName << ": " << getLastError()));
 
@@ -110,11 +212,132 @@ RawImage::ptr RawImage::load(const std::string& fileName, const Masked::ptr& opt
     if (magic != "P5")
         throw ImageException(VA_STR(fileName << " seems not to be a valid PGM file"));
 
-    return loadPGM(fileName, in, header, opticalBlack? *opticalBlack : RawImage::Masked { 0, 0 });
+    RawImage::ptr image = loadPGM(fileName, in, header, opticalBlack? *opticalBlack : RawImage::Masked { 0, 0 }, access);
+    stage.add(image->pixelCount(false), image->length);
+    return image;
+}
+
+RawImage::ptr RawImage::load(const std::string& fileName, const Packed& packed, const Masked::ptr& opticalBlack)
+{
+    Profile::Scope stage("RawImage::load packed");
+    imgsize_t width = packed.width;
+    imgsize_t height = packed.height;
+    uint64_t rowBytes = uint64_t(width) * 2;
+    if ((packed.format == Packed::Format::RAW10) && (width % 4))
+        throw ImageException(VA_STR(fileName << ": RAW10 rows require a multiple of 4 pixels"));
+    if ((packed.format == Packed::Format::RAW12) && (width % 2))
+        throw ImageException(VA_STR(fileName << ": RAW12 rows require an even number of pixels"));
+    if (packed.format == Packed::Format::RAW10) rowBytes = width / 4 * 5;
+    if (packed.format == Packed::Format::RAW12) rowBytes = width / 2 * 3;
+    bitdepth_t mask = packed.format == Packed::Format::LE12? 0x0FFF : 0x3FFF;
+
+    std::ifstream in(fileName.c_str(), std::ios::binary);
+    if (!in) throw ImageException(VA_STR("opening " << fileName << ": " << getLastError()));
+    in.seekg(0, std::ios::end);
+    uint64_t fileSize = uint64_t(std::streamoff(in.tellg()));
+    uint64_t payload = rowBytes * height;
+    if (!payload || (fileSize < payload))
+        throw ImageException(VA_STR(fileName << " too short for a " << width << "x" << height << " packed image"));
+    in.seekg(std::streamoff(fileSize - payload), std::ios::beg);
+
+    RawImage::ptr image = RawImage::create(width, height, opticalBlack? *opticalBlack : RawImage::Masked { 0, 0 });
+    imgsize_t blockRows = imgsize_t(std::max(uint64_t(1), (uint64_t(1) << 20) / rowBytes)); // read about 1 MB at once
+    std::vector<uint8_t> block(std::size_t(rowBytes * std::min(blockRows, height)));
+    for (imgsize_t y = 0; y < height; y += blockRows)
+    {
+        imgsize_t rows = std::min(blockRows, height - y);
+        uint64_t pixels = uint64_t(rows) * width;
+        {
+            Profile::Scope reading("RawImage::load read", pixels, rowBytes * rows);
+            if (!in.read((char *) block.data(), std::streamsize(rowBytes * rows)))
+                throw ImageException(VA_STR("error reading " << fileName));
+        }
+        Profile::Scope unpacking("RawImage::load unpack", pixels, rowBytes * rows + pixels * sizeof(bitdepth_t));
+        for (imgsize_t r = 0; r < rows; r++)
+        {
+            const uint8_t* source = block.data() + r * rowBytes;
+            bitdepth_t* target = image->data + std::size_t(y + r) * width;
+            switch (packed.format)
+            {
+                case Packed::Format::RAW10: PixelKernels::unpack10(source, width / 4, target); break;
+                case Packed::Format::RAW12: PixelKernels::unpack12(source, width / 2, target); break;
+                default:                    PixelKernels::unpackWords(source, width, mask, target); break;
+            }
+        }
+    }
+
+    auto pd = fileName.find_last_of("\\/");
+    image->name = fileName.substr((pd == std::string::npos)? 0 : pd + 1);
+    stage.add(image->pixelCount(false), payload);
+    return image;
+}
+
+RawImage::ptr RawImage::share(const RawImage::ptr& source, const RawImage::Masked::ptr& opticalBlack)
+{
+    RawImage::ptr image(new RawImage(source->rowPixels, source->colPixels, opticalBlack? *opticalBlack : Masked { 0, 0 },
+                                     source->bytes, source, source->swapped));
+    image->origin = source;
+    image->name = source->name;
+    image->cfa = source->cfa;
+    image->defects = source->defects;
+    return image;
+}
+
+void RawImage::deinterleave()
+{
+    if (planes || !bytes) return; // (streamed images are never held in memory, not even as planes)
+    if (origin && (origin->bayerStart() == bayerStart())) // built once for every image sharing them
+    {
+        origin->deinterleave();
+        planes = origin->planes;
+        return;
+    }
+
+    std::size_t planeWidth = bayerWidth() / 2;
+    std::size_t planeSize = planeWidth * (bayerHeight() / 2);
+    Profile::Scope stage("RawImage::deinterleave", planeSize * 4, planeSize * 4 * sizeof(bitdepth_t));
+    planes = std::shared_ptr<bitdepth_t>(new bitdepth_t[planeSize * 4], std::default_delete<bitdepth_t[]>());
+
+    bitdepth_t* quad[4]; // [row parity * 2 + column parity]
+    for (std::size_t q = 0; q < 4; q++) quad[q] = planes.get() + q * planeSize;
+    const uint8_t* even = bytes + bayerStart() * sizeof(bitdepth_t);
+    std::size_t rowBytes = std::size_t(rowPixels) * sizeof(bitdepth_t);
+    for (std::size_t offset = 0; offset < planeSize; offset += planeWidth) // single pass (two rows at a time)
+    {
+        PixelKernels::deinterleave(even, imgsize_t(planeWidth), quad[0] + offset, quad[1] + offset, swapped);
+        PixelKernels::deinterleave(even + rowBytes, imgsize_t(planeWidth), quad[2] + offset, quad[3] + offset, swapped);
+        even += 2 * rowBytes;
+    }
+}
+
+void RawImage::buildIndex(const std::string& imageFile)
+{
+    if (integral) return;
+    if (origin && (origin->bayerStart() == bayerStart()) && (origin->defects == defects))
+    {
+        origin->buildIndex(imageFile);
+        integral = origin->integral;
+        return;
+    }
+    Profile::Scope stage("RawImage::buildIndex", pixelCount(false), length);
+    std::string sidecar = imageFile + ".sat";
+    bool cached = !imageFile.empty() && !defects; // (the sidecar holds the pixels as found in the file)
+    if (cached) integral = IntegralImage::load(sidecar, *this, imageFile);
+    if (integral) return;
+    integral = IntegralImage::build(*this);
+    if (cached) integral->save(sidecar, *this, imageFile);
+}
+
+const bitdepth_t* RawImage::plane(const ImageFilter& filter) const
+{
+    if (!planes || (filter.xdelta != 2) || (filter.ydelta != 2)) return nullptr;
+    std::size_t planeSize = std::size_t(bayerWidth() / 2) * (bayerHeight() / 2);
+    return planes.get() + planeSize * (filter.yshift * 2 + filter.xshift_e); // (by quad position, whatever the CFA)
 }
 
 void RawImage::save(const std::string& fileName) const
 {
+    Profile::Scope stage("RawImage::save", length / sizeof(bitdepth_t), length);
     auto ep = fileName.find_last_of(".");
     if (ep == std::string::npos) ep = 0;
     std::string format = String::tolower(fileName.substr(ep));
@@ -122,32 +345,24 @@ void RawImage::save(const std::string& fileName) const
     bool isPGM = format == ".pgm";
     bool isPPM = format == ".ppm";
     bool isTIFF = format == ".tiff";
+    bool swap = (isPGM || isPPM)? !ByteOrder::isBigEndian() && !swapped : swapped; // PGM/PPM big endian, others native
     if (!isDat && !isPGM && !isPPM && !isTIFF)
         throw ImageException(VA_STR("unsupported write file format '" << format << "'"));
     std::ofstream out(fileName.c_str(), std::ios::binary);
     if (!out) throw ImageException(VA_STR("error opening " << fileName << ": " << getLastError()));
     try
     {
-        std::shared_ptr<const RawImage> toSave = shared_from_this();
         if (isPGM || isPPM)
         {
             std::string header = VA_STR("P" << (isPGM? '5' : '6') << "\n"
                                             << (isPGM? rowPixels : rowPixels/3) << " " << colPixels << "\n65535\n");
             if (!out.write(header.c_str(), std::streamsize(header.length()))) throw true;
-            try { toSave = RawImage::create(rowPixels, colPixels, masked); } catch(...) { throw true; }
-            std::memcpy(toSave->data, data, length);
-            bitdepth_t* pixel = toSave->data;
-            for (imgsize_t px = 0; px < toSave->length; px++)
-            {
-                *pixel = endian(*pixel);
-                pixel++;
-            }
         }
         else if (isTIFF)
         {
             auto write16 = [&out](uint16_t value) { if (!out.write((const char*) &value, sizeof(value))) throw true; };
             auto write32 = [&out](uint32_t value) { if (!out.write((const char*) &value, sizeof(value))) throw true; };
-            if (!(out << (isBigEndian()? "MM" : "II"))) throw true;
+            if (!(out << (ByteOrder::isBigEndian()? "MM" : "II"))) throw true;
             write16(42); // TIFF version
             uint32_t ifd_offset = 8;
             uint16_t ifd_entries = 8;
@@ -165,11 +380,28 @@ void RawImage::save(const std::string& fileName) const
             write16(0x111); write16(4); write32(1); write32(image_offset);     // StripOffsets
             write16(0x115); write16(3); write32(1); write32(samplesPerPixel);  // SamplesPerPixel
             write16(0x116); write16(3); write32(1); write32(colPixels);        // RowsPerStrip
-            write16(0x117); write16(4); write32(1); write32(toSave->length);   // StripByteCounts
+            write16(0x117); write16(4); write32(1); write32(uint32_t(length));            // StripByteCounts
             write32(no_next_ifd);
             write16(bitdepth); write16(bitdepth); write16(bitdepth); // bits per sample (R,G,B)
         }
-        if (!out.write((const char*) toSave->data, toSave->length)) throw true;
+        if (swap || !bytes) // streaming conversion through a small buffer (no copy of the whole image)
+        {
+            std::vector<bitdepth_t> block(std::size_t(1) << 16);
+            uint64_t samples = length / sizeof(bitdepth_t);
+            for (uint64_t px = 0; px < samples; px += block.size())
+            {
+                std::size_t count = std::size_t(std::min(uint64_t(block.size()), samples - px));
+                const void* source = block.data();
+                if (bytes) source = bytes + px * sizeof(bitdepth_t); else read(px, count, block.data());
+                if (swap)
+                {
+                    Profile::Scope swapping("RawImage::save byteswap", count, count * sizeof(bitdepth_t));
+                    ByteOrder::swap16(source, block.data(), count);
+                }
+                if (!out.write((const char*) block.data(), std::streamsize(count * sizeof(bitdepth_t)))) throw true;
+            }
+        }
+        else if (!out.write((const char*) bytes, std::streamsize(length))) throw true;
         out.close();
         if (out.fail()) throw true;
     }
@@ -179,3 +411,18 @@ void RawImage::save(const std::string& fileName) const
         throw ImageException(reason);
     }
 }
+
+std::istream& operator>>(std::istream& in, RawImage::Packed::Format& format)
+{
+    std::string str;
+    if (in >> str)
+    {
+        str = String::toupper(str);
+             if (!str.compare("RAW10")) format = RawImage::Packed::Format::RAW10;
+        else if (!str.compare("RAW12")) format = RawImage::Packed::Format::RAW12;
+        else if (!str.compare("LE12"))  format = RawImage::Packed::Format::LE12;
+        else if (!str.compare("LE14"))  format = RawImage::Packed::Format::LE14;
+        else in.setstate(std::ios_base::failbit);
+    }
+    return in;
+}
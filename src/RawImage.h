@@ -40,15 +40,35 @@ class RawImage : public std::enable_shared_from_this<RawImage>
             imgsize_t top;
         };
 
+        struct Packed // headerless sensor dump layout (file read instead as a PGM one)
+        {
+            enum class Format { RAW10, RAW12, LE12, LE14 }; // MIPI CSI-2 packing or little endian 16-bit words
+            Format format;
+            imgsize_t width;
+            imgsize_t height;
+        };
+
         typedef std::map<ImageFilter::Code, double> BlackLevel;
 
+        enum class Access
+        {
+            Copy, // pixels read into private memory (in the native byte order)
+            Map,  // file mapped in memory when possible: pixels served straight from the OS page cache
+            Stream // rows read from the file when required (bounded memory: frames larger than the RAM)
+        };
+
     private:
 
-        explicit RawImage(imgsize_t width, imgsize_t height, const Masked& opticalBlack)
-          : length(imgsize_t(sizeof(bitdepth_t) * width * height)),
-            data(new bitdepth_t[length]),
+        explicit RawImage(imgsize_t width, imgsize_t height, const Masked& opticalBlack,
+                          uint8_t* mappedPixels = nullptr, const std::shared_ptr<void>& mapping = nullptr,
+                          bool foreignByteOrder = false)
+          : length(uint64_t(sizeof(bitdepth_t)) * width * height),
+            data(mapping? aligned(mappedPixels) : new bitdepth_t[std::size_t(length / sizeof(bitdepth_t))]),
+            bytes(mapping? mappedPixels : reinterpret_cast<uint8_t*>(data)),
             rowPixels(width), colPixels(height),
-            masked { opticalBlack.left < width? opticalBlack.left : 0, opticalBlack.top < height? opticalBlack.top : 0 }
+            masked { opticalBlack.left < width? opticalBlack.left : 0, opticalBlack.top < height? opticalBlack.top : 0 },
+            swapped(foreignByteOrder),
+            storage(mapping)
         {}
 
         RawImage& operator=(const RawImage&) = delete;
@@ -56,7 +76,7 @@ class RawImage : public std::enable_shared_from_this<RawImage>
 
     public:
 
-        virtual ~RawImage() { if(data) delete []data; }
+        virtual ~RawImage() { if(data && !storage) delete []data; }
 
         static RawImage::ptr create(imgsize_t width, imgsize_t height, const RawImage::Masked& opticalBlack)
         {
@@ -65,54 +85,122 @@ class RawImage : public std::enable_shared_from_this<RawImage>
 
         static RawImage::ptr layout(const RawImage::ptr& config) // memory allocated but data not copied
         {
-            return create(config->rowPixels, config->colPixels, config->masked);
+            RawImage::ptr image = create(config->rowPixels, config->colPixels, config->masked);
+            image->cfa = config->cfa;
+            return image;
         }
 
-        static RawImage::ptr load(const std::string& fileName, const RawImage::Masked::ptr& opticalBlack = Masked::ptr());
+        static RawImage::ptr load(const std::string& fileName, const RawImage::Masked::ptr& opticalBlack = Masked::ptr(),
+                                  Access access = Access::Copy);
+
+        // the pixels are the last bytes of the file (whatever precedes them, like a small header, is skipped)
+        static RawImage::ptr load(const std::string& fileName, const Packed& packed,
+                                  const RawImage::Masked::ptr& opticalBlack = Masked::ptr());
+
+        // another image over the same (not to be modified) pixels, with its own mask, black and white levels
+        static RawImage::ptr share(const RawImage::ptr& source, const RawImage::Masked::ptr& opticalBlack = Masked::ptr());
+
+        static void prefetch(const std::string& fileName); // hints the OS to start reading a file about to be loaded
 
         void save(const std::string& fileName) const;
 
         ImageChannel::ptr getChannel(const ImageFilter& imageFilter) const
         {
-            return ImageChannel::ptr(new ImageChannel(shared_from_this(), imageFilter));
+            return ImageChannel::ptr(new ImageChannel(shared_from_this(), cfa.map(imageFilter))); // (as laid out by the CFA)
         }
 
+        void deinterleave(); // builds (once) a planar copy of the four quad positions, much faster to scan
+
+        const bitdepth_t* plane(const ImageFilter& filter) const; // planar quad position (nullptr if not available)
+
+        /* Builds (once) the summed-area tables of the channels, answering the statistics of any selection without
+         * scanning it; if the image file name is given they are reused from (or saved to) the imageFile.sat sidecar
+         */
+        void buildIndex(const std::string& imageFile = std::string());
+
+        std::shared_ptr<const class IntegralImage> index() const { return integral; } // nullptr if not built
+
         bool sameSizeAs(const RawImage::ptr& that) const
         {
             return (rowPixels == that->rowPixels) && (colPixels == that->colPixels)
                 && (masked.left == that->masked.left) && (masked.top == that->masked.top);
         }
 
-        imgsize_t pixelCount(bool effective = true) const
+        uint64_t pixelCount(bool effective = true) const
         {
-            return (rowPixels - (effective? masked.left : 0)) * (colPixels - (effective? masked.top : 0));
+            return uint64_t(rowPixels - (effective? masked.left : 0)) * (colPixels - (effective? masked.top : 0));
         }
 
+        // 'samples' consecutive pixels from the file of a streamed image, in the file byte order (see 'swapped')
+        void read(uint64_t first, std::size_t samples, bitdepth_t* buffer) const;
+
         inline imgsize_t bayerStart() const { return yalign() * rowPixels + xalign(); }
 
         inline imgsize_t bayerWidth() const { return rowPixels - xalign(); }
 
         inline imgsize_t bayerHeight() const { return colPixels - yalign(); }
 
-        const imgsize_t length;
+        const uint64_t length; // in bytes
         bitdepth_t* const data; // std::vector would require a wasteful and unuseful memory initialization
+                                // (nullptr if the image is streamed: the rows are then read on demand)
+        uint8_t* const bytes;   // the same pixels, also when mapped at an odd file offset (then 'data' is nullptr:
+                                // only unaligned-safe loads, like memcpy, may read them)
 
         const imgsize_t rowPixels; // physical image dimensions
         const imgsize_t colPixels;
 
         const Masked masked;
 
+        const bool swapped; // pixels kept in the file byte order (mapped PGM on a little endian machine)
+
         BlackLevel blackLevel;
         std::shared_ptr<bitdepth_t> whiteLevel;
 
+        Cfa cfa; // RGGB unless told otherwise
+
+        std::shared_ptr<const class DefectMap> defects; // replaced as the rows are read (nullptr if none)
+
         std::string name;
 
         bool hasBlackLevel() const { return !blackLevel.empty(); }
 
     private:
 
+        static RawImage::ptr loadPGM(const std::string& fileName, std::istream& in, std::istream& header,
+                                     const Masked& opticalBlack, Access access);
+
+        static RawImage::ptr mapPGM(const std::string& fileName, uint64_t offset,
+                                    imgsize_t width, imgsize_t height, const Masked& opticalBlack);
+
+        static RawImage::ptr streamPGM(const std::string& fileName, uint64_t offset,
+                                       imgsize_t width, imgsize_t height, const Masked& opticalBlack);
+
+        struct Stream // the file of a streamed image
+        {
+            int descriptor;
+            uint64_t offset; // of the first pixel
+        };
+
+        const std::shared_ptr<void> storage; // the file mapping when the pixels aren't owned by the object
+
+        std::shared_ptr<const Stream> stream; // when streamed (also held by the storage)
+
+        std::shared_ptr<bitdepth_t> planes; // the quad positions one after another (R, G1, G2 & B on RGGB; a snapshot)
+
+        std::shared_ptr<const class IntegralImage> integral; // also a snapshot
+
+        RawImage::ptr origin; // owner of the pixels of a shared image (also of its planes & index if aligned alike)
+
+        static bitdepth_t* aligned(uint8_t* pixels) // (nullptr if they can't be accessed as 16-bit words)
+        {
+            return reinterpret_cast<std::uintptr_t>(pixels) % alignof(bitdepth_t)? nullptr
+                 : reinterpret_cast<bitdepth_t*>(static_cast<void*>(pixels));
+        }
+
         inline imgsize_t xalign() const { return masked.left & 1; } // pixels to skip from left & top (odd size in
         inline imgsize_t yalign() const { return masked.top & 1; }  // optical black area causing Bayer misalignment)
 };
 
+std::istream& operator>>(std::istream& in, RawImage::Packed::Format& format);
+
 #endif /* RAWIMAGE_H_ */
@@ -0,0 +1,152 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <sstream>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#include "Util.hpp"
+#include "ImageSelection.h"
+#include "Server.h"
+
+std::string getLastError();
+
+static std::mutex requests; // the handler (image cache included) is not thread safe
+
+static bool respond(const std::string& line, std::ostream& out, const Server::Handler& handler) // false to close
+{
+    auto words = Server::split(line);
+    if (words.empty()) return true;
+    if (String::tolower(words[0]) == "quit") return false;
+    int status;
+    {
+        std::lock_guard<std::mutex> lock(requests);
+        try { status = handler(words, out); }
+        catch (std::exception& e) // a bad request must not stop the server
+        {
+            out << "ERROR: " << e.what() << std::endl;
+            status = 4;
+        }
+    }
+    out << "#END " << status << std::endl;
+    return true;
+}
+
+void Server::serve(std::istream& in, std::ostream& out, const Handler& handler)
+{
+    for (std::string line; std::getline(in, line);) if (!respond(line, out, handler)) break;
+}
+
+void Server::listen(const std::string& socketPath, const Handler& handler)
+{
+#ifdef _WIN32
+    (void) socketPath; (void) handler;
+    throw ImageException("Unix domain sockets not supported on this platform");
+#else
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.length() >= sizeof(address.sun_path)) throw ImageException(VA_STR("too long path " << socketPath));
+    std::strcpy(address.sun_path, socketPath.c_str());
+
+    struct stat existing;
+    if (!lstat(socketPath.c_str(), &existing)) // only a stale socket of a previous run is removed
+    {
+        if (!S_ISSOCK(existing.st_mode)) throw ImageException(VA_STR(socketPath << " exists and is not a socket"));
+        unlink(socketPath.c_str());
+    }
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) throw ImageException(VA_STR("socket: " << getLastError()));
+    if (bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) || ::listen(server, 16))
+    {
+        std::string reason = getLastError();
+        close(server);
+        throw ImageException(VA_STR("listening on " << socketPath << ": " << reason));
+    }
+
+    for (;;)
+    {
+        int client = accept(server, nullptr, nullptr);
+        if (client < 0) continue;
+        std::thread([client, handler]() // a thread per connection: slow clients don't block the others
+        {
+            std::string pending;
+            char buffer[4096];
+            for (bool open = true; open;)
+            {
+                ssize_t received = recv(client, buffer, sizeof(buffer), 0);
+                if (received <= 0) break;
+                pending.append(buffer, std::size_t(received));
+                for (auto eol = pending.find('\n'); open && (eol != std::string::npos); eol = pending.find('\n'))
+                {
+                    std::ostringstream out;
+                    open = respond(pending.substr(0, eol), out, handler);
+                    pending.erase(0, eol + 1);
+                    std::string response = out.str();
+                    for (std::size_t sent = 0; open && (sent < response.length());)
+                    {
+                        ssize_t done = send(client, response.data() + sent, response.length() - sent, MSG_NOSIGNAL);
+                        if (done <= 0) open = false; else sent += std::size_t(done);
+                    }
+                }
+            }
+            close(client);
+        }).detach();
+    }
+#endif
+}
+
+std::vector<std::string> Server::split(const std::string& line)
+{
+    std::vector<std::string> words;
+    std::string word;
+    bool inWord = false;
+    char quote = 0;
+    for (char c : line)
+    {
+        if (quote)
+        {
+            if (c == quote) quote = 0; else word += c;
+        }
+        else if ((c == '"') || (c == '\''))
+        {
+            quote = c;
+            inWord = true;
+        }
+        else if (std::isspace(static_cast<unsigned char>(c)))
+        {
+            if (inWord) words.emplace_back(word);
+            word.clear();
+            inWord = false;
+        }
+        else
+        {
+            word += c;
+            inWord = true;
+        }
+    }
+    if (inWord) words.emplace_back(word);
+    return words;
+}
@@ -0,0 +1,42 @@
+/*
+ *  HRAW - Hacker's toolkit for image sensor characterisation
+ *  Copyright 2016-2018 Ciriaco Garcia de Celis
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/* Long-running mode: every input line is a command (with its arguments, as in the command line) whose output
+ * is followed by a "#END status" line. Requests are executed one at a time; "quit" closes the connection.
+ */
+struct Server
+{
+    typedef std::function<int(const std::vector<std::string>& words, std::ostream& out)> Handler; // returns status
+
+    static void serve(std::istream& in, std::ostream& out, const Handler& handler); // until end of input or "quit"
+
+    static void listen(const std::string& socketPath, const Handler& handler); // Unix domain socket (never returns)
+
+    static std::vector<std::string> split(const std::string& line); // words separated by blanks (quotes allowed)
+};
+
+#endif /* SERVER_H_ */
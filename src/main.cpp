@@ -18,11 +18,28 @@
 
 #include <sstream>
 #include <iostream>
+#include <fstream>
+#include <functional>
+#include <array>
+#include <limits>
+#include <numeric>
+#include <mutex>
+#include <thread>
 #include <cmath>
+#ifndef _WIN32
+#include <glob.h>
+#endif
 #include "Util.hpp"
 #include "RawImage.h"
 #include "ImageMath.h"
 #include "ImageAlgo.h"
+#include "Parallel.h"
+#include "FrameCache.h"
+#include "Server.h"
+#include "Benchmark.h"
+#include "Profile.h"
+#include "DefectMap.h"
+#include "Cpu.hpp"
 
 void demo()
 {
@@ -133,18 +150,21 @@ void demo()
 
 struct ExitNotif { std::string errMsg; };
 
+std::string getLastError();
+
 struct Loop { int deltaX, deltaY, count; };
 
-template <typename T, typename Iter> struct IterationKit
-{
-    T object;
-    Iter cur, last;
-};
+typedef std::function<RawImage::ptr(const std::string& fileName, const RawImage::Masked::ptr& opticalBlack,
+                                    RawImage::Access access)> Loader;
 
-void histogram2csv(const RawImage::ptr& image, const std::shared_ptr<ImageCrop>& crop)
+void histogram2csv(std::ostream& out, const RawImage::ptr& image, const std::shared_ptr<ImageCrop>& crop)
 {
-    typedef IterationKit<ImageMath::Histogram::ptr, ImageMath::Histogram::Frequencies::const_iterator> HistoIter;
-    std::vector<HistoIter> histoIter;
+    struct HistoColumn
+    {
+        ImageMath::Histogram::ptr histogram;
+        int64_t last; // highest level still to report
+    };
+    std::vector<HistoColumn> columns;
     auto wclip = image->whiteLevel; // note: when this parameter is provided a *FAKE* histogram is generated
 
     auto appendHistogram = [&](const ImageFilter& filter)
@@ -152,51 +172,41 @@ void histogram2csv(const RawImage::ptr& image, const std::shared_ptr<ImageCrop>&
         auto channel = image->getChannel(filter);
         auto area = channel->select(crop);
         auto histogram = ImageMath::buildHistogram(area);
-        if (wclip && !histogram->data.empty())
+        if (wclip && !histogram->empty())
         {
-            auto it = histogram->data.cbegin();
-            auto itnext = ++it;
-            while (itnext != histogram->data.cend()) // "smooth" the scaling if white clipping provided
-            {
-                if ((itnext->first - it->first == 2) && (!wclip || (itnext->first < *wclip)))
-                    histogram->data.emplace(it->first + 1, (it->second + itnext->second) / 2);
-                it = itnext;
-                ++itnext;
-            }
+            auto bins = histogram->sparse();
+            for (std::size_t i = 2; i < bins.size(); i++) // "smooth" the scaling if white clipping provided
+                if ((bins[i].first - bins[i-1].first == 2) && (bins[i].first < *wclip))
+                    histogram->data[bins[i].first - 1u] = (bins[i-1].second + bins[i].second) / 2;
         }
-        histoIter.emplace_back(HistoIter { histogram, histogram->data.cbegin(), histogram->data.cend() });
-        std::cout << ";" << filter.code;
+        columns.emplace_back(HistoColumn { histogram, histogram->empty()? -1 : histogram->highest });
+        out << ";" << filter.code;
     };
 
     appendHistogram(ImageFilter::R());
     appendHistogram(ImageFilter::G1());
     appendHistogram(ImageFilter::G2());
     appendHistogram(ImageFilter::B());
-    std::cout << std::endl;
+    out << std::endl;
 
     bitdepth_t blackLevel = image->hasBlackLevel()? bitdepth_t(std::round(image->blackLevel[ImageFilter::Code::RGB])) : 0;
 
     int64_t val = std::numeric_limits<int64_t>::max();
-    for (const auto& i : histoIter) if (i.cur->first < val) val = i.cur->first; // starting point
+    for (const auto& c : columns) if (!c.histogram->empty() && (c.histogram->lowest < val)) val = c.histogram->lowest;
 
     std::stringstream line;
     for (bool isEof = false; !isEof;)
     {
         line.str(std::string());
         isEof = true;
-        for (auto i = histoIter.begin(); i != histoIter.end(); ++i)
+        for (auto& c : columns)
         {
-            if ((i->cur == i->last) || (val < i->cur->first)) line << ";0";
-            else
-            {
-                line << ";" << i->cur->second;
-                ++i->cur;
-            }
-            if (wclip && (*wclip == val)) i->last = i->cur;
-            if (i->cur != i->last) isEof = false;
+            line << ";" << (val <= c.last? c.histogram->data[std::size_t(val)] : 0);
+            if (wclip && (*wclip == val) && (val < c.last)) c.last = val;
+            if (val < c.last) isEof = false;
         }
         if (isEof && wclip) break;
-        std::cout << (val - blackLevel) << line.str() << std::endl;
+        out << (val - blackLevel) << line.str() << std::endl;
         val++;
     }
 
@@ -205,40 +215,39 @@ void histogram2csv(const RawImage::ptr& image, const std::shared_ptr<ImageCrop>&
         auto overexp = val;
         val -= blackLevel;
         int zleft = 0;
-        int zright = int(histoIter.size() - 1);
-        for (auto i = histoIter.begin(); i != histoIter.end(); ++i)
+        int zright = int(columns.size() - 1);
+        for (const auto& c : columns)
         {
             line.str(std::string());
-            for (auto c = 0; c < zleft; c++) line << ";0";
-            auto expmax = i->last;
-            --expmax;
-            line << ";" << (expmax->first == overexp? expmax->second : 0);
-            for (auto c = 0; c < zright; c++) line << ";0";
+            for (auto z = 0; z < zleft; z++) line << ";0";
+            line << ";" << (overexp <= c.last? c.histogram->data[std::size_t(overexp)] : 0);
+            for (auto z = 0; z < zright; z++) line << ";0";
             int bwidth = int(double(val) * 0.02);
-            for (auto right = val + bwidth; val < right; val++) std::cout << val << ";0;0;0;0" << std::endl;
+            for (auto right = val + bwidth; val < right; val++) out << val << ";0;0;0;0" << std::endl;
             for (auto right = val + bwidth; val < right; val += 2)
-                std::cout << val << line.str() << std::endl << (val + 1) << ";0;0;0;0" << std::endl;
+                out << val << line.str() << std::endl << (val + 1) << ";0;0;0;0" << std::endl;
             zleft++; zright--;
         }
     }
 }
 
-void stats(const RawImage::ptr& raw, const ImageFilter& analyzeChannel, const std::shared_ptr<ImageCrop>& crop)
+void stats(std::ostream& out, const RawImage::ptr& raw, const ImageFilter& analyzeChannel, const std::shared_ptr<ImageCrop>& crop)
 {
-    ImageChannel::ptr channel = raw->getChannel(analyzeChannel);
-    ImageSelection::ptr area = channel->select(crop);
-    auto stArea = ImageMath::analyze(area);
+    std::vector<ImageSelection::ptr> areas; // every site of the color in the CFA period (a single one if 2x2)
+    for (const auto& site : raw->cfa.sites(analyzeChannel.code)) // (-crop in CFA periods if larger)
+        areas.push_back(std::make_shared<ImageChannel>(raw, site)->select(crop));
+    auto stArea = ImageMath::analyze(areas);
     auto whiteLevel = raw->whiteLevel? *raw->whiteLevel : stArea.max;
-    auto blackLevel = raw->hasBlackLevel()? channel->blackLevel() : stArea.mean;
+    auto blackLevel = raw->hasBlackLevel()? areas.front()->channel->blackLevel() : stArea.mean;
     double dr = log((whiteLevel - blackLevel) / stArea.stdev) / log(2);
-    double mp = raw->pixelCount() / 1000000.0;
+    double mp = double(raw->pixelCount()) / 1000000.0;
     double dr8 = dr + log(sqrt(mp/8)) / log(2);
-    std::cout << "min;max;mean;stdev;DR@" << int(mp+0.5) << ";DR@8" << std::endl;
-    std::cout << stArea.min << ";" << stArea.max << ";" << stArea.mean << ";" << stArea.stdev
+    out << "min;max;mean;stdev;DR@" << int(mp+0.5) << ";DR@8" << std::endl;
+    out << stArea.min << ";" << stArea.max << ";" << stArea.mean << ";" << stArea.stdev
               << ";" << dr << ";" << dr8 << std::endl;
 }
 
-void mskstats(const RawImage::ptr& raw, const ImageFilter& analyzeChannel)
+void mskstats(std::ostream& out, const RawImage::ptr& raw, const ImageFilter& analyzeChannel)
 {
     ImageChannel::ptr channel = raw->getChannel(analyzeChannel);
     ImageSelection::ptr maskedPixels = channel->getLeftMask();
@@ -247,18 +256,18 @@ void mskstats(const RawImage::ptr& raw, const ImageFilter& analyzeChannel)
     auto stImage = ImageMath::analyze(image);
     auto whitePoint = raw->whiteLevel;
     double dr = log((1.0 * (whitePoint? *whitePoint : stImage.max) - stMasked.mean) / stMasked.stdev) / log(2);
-    double mp = raw->pixelCount() / 1000000.0;
+    double mp = double(raw->pixelCount()) / 1000000.0;
     double dr8 = dr + log(sqrt(mp/8)) / log(2);
-    std::cout << "ReadNoise=" << stMasked.stdev << " DR@" << int(mp+0.5) << "=" << dr
+    out << "ReadNoise=" << stMasked.stdev << " DR@" << int(mp+0.5) << "=" << dr
               << " DR@8=" << dr8 << " file { " << raw->name << " }" << std::endl;
-    std::cout << "image { mean=" << stImage.mean << " min=" << stImage.min << " max=" << stImage.max << " }"
+    out << "image { mean=" << stImage.mean << " min=" << stImage.min << " max=" << stImage.max << " }"
               << " left mask { mean=" << stMasked.mean << " min=" << stMasked.min << " max=" << stMasked.max
               << " crop=" << maskedPixels->width << "x" << maskedPixels->height
                           << "+" << maskedPixels->x << "+" << maskedPixels->y << " }"
               << std::endl;
 }
 
-void rgbStats2csv(const RawImage::ptr& raw, const std::shared_ptr<ImageCrop>& crop, const std::shared_ptr<Loop>& loop)
+void rgbStats2csv(std::ostream& out, const RawImage::ptr& raw, const std::shared_ptr<ImageCrop>& crop, const std::shared_ptr<Loop>& loop)
 {
     ImageChannel::ptr red = raw->getChannel(ImageFilter::R());
     ImageChannel::ptr gr1 = raw->getChannel(ImageFilter::G1());
@@ -277,13 +286,13 @@ void rgbStats2csv(const RawImage::ptr& raw, const std::shared_ptr<ImageCrop>& cr
     int count = loop? loop->count : 1; // iterations count (less than 2: no movement)
 
     std::string csvpad = std::string(std::size_t((count > 1? 1 : 13) + (deltaX? 1 : 0) + (deltaY? 1 : 0)), ';');
-    std::cout << "width;height;X;Y" << csvpad << std::endl
+    out << "width;height;X;Y" << csvpad << std::endl
               << width << ";" << height << ";" << cx << ";" << cy << csvpad << std::endl << std::endl;
 
     if (count > 1)
-        std::cout << (deltaX? "X;" : "") << (deltaY? "Y;" : "") << "R;G1;G2;B;" << std::endl; // only mean reported
+        out << (deltaX? "X;" : "") << (deltaY? "Y;" : "") << "R;G1;G2;B;" << std::endl; // only mean reported
     else
-        std::cout << "R mean;R min;R max;R stdev;G1 mean;G1 min;G1 max;G1 stdev;"
+        out << "R mean;R min;R max;R stdev;G1 mean;G1 min;G1 max;G1 stdev;"
                      "G2 mean;G2 min;G2 max;G2 stdev;B mean;B min;B max;B stdev;" << std::endl; // full stats
 
     auto black_red = raw->hasBlackLevel()? red->blackLevel() : 0;
@@ -291,47 +300,438 @@ void rgbStats2csv(const RawImage::ptr& raw, const std::shared_ptr<ImageCrop>& cr
     auto black_gr2 = raw->hasBlackLevel()? gr2->blackLevel() : 0;
     auto black_blu = raw->hasBlackLevel()? blu->blackLevel() : 0;
 
+    ImageMath::BayerWindow window(red->select(cx, cy, width, height)); // single pass over the four channels
+
     for (int iter = count; iter > 0; iter--)
     {
-        ImageSelection::ptr area = red->select(cx, cy, width, height);
-        auto stats = ImageMath::analyze(area);
-        if (deltaX) std::cout << cx << ";";
-        if (deltaY) std::cout << cy << ";";
-        std::cout << stats.mean - black_red;
-        if (count < 2) std::cout << ";" << stats.min - black_red << ";" << stats.max - black_red << ";" << stats.stdev;
-        area = gr1->select(cx, cy, width, height);
-        stats = ImageMath::analyze(area);
-        std::cout << ";" << stats.mean - black_gr1;
-        if (count < 2) std::cout << ";" << stats.min - black_gr1 << ";" << stats.max - black_gr1 << ";" << stats.stdev;
-        area = gr2->select(cx, cy, width, height);
-        stats = ImageMath::analyze(area);
-        std::cout << ";" << stats.mean - black_gr2;
-        if (count < 2) std::cout << ";" << stats.min - black_gr2 << ";" << stats.max - black_gr2 << ";" << stats.stdev;
-        area = blu->select(cx, cy, width, height);
-        stats = ImageMath::analyze(area);
-        std::cout << ";" << stats.mean - black_blu;
-        if (count < 2) std::cout << ";" << stats.min - black_blu << ";" << stats.max - black_blu << ";" << stats.stdev;
-        std::cout << ";" << std::endl;
+        if (iter < count) window.move(deltaX, deltaY); // incremental update of the overlapping selections
+        auto stats = window.stats();
+        if (deltaX) out << cx << ";";
+        if (deltaY) out << cy << ";";
+        out << stats.r.mean - black_red;
+        if (count < 2) out << ";" << stats.r.min - black_red << ";" << stats.r.max - black_red << ";" << stats.r.stdev;
+        out << ";" << stats.g1.mean - black_gr1;
+        if (count < 2) out << ";" << stats.g1.min - black_gr1 << ";" << stats.g1.max - black_gr1 << ";" << stats.g1.stdev;
+        out << ";" << stats.g2.mean - black_gr2;
+        if (count < 2) out << ";" << stats.g2.min - black_gr2 << ";" << stats.g2.max - black_gr2 << ";" << stats.g2.stdev;
+        out << ";" << stats.b.mean - black_blu;
+        if (count < 2) out << ";" << stats.b.min - black_blu << ";" << stats.b.max - black_blu << ";" << stats.b.stdev;
+        out << ";" << std::endl;
         cx += imgsize_t(deltaX);
         cy += imgsize_t(deltaY);
     }
 
-    std::cout << std::endl << std::endl;
+    out << std::endl << std::endl;
 }
 
-int main(int argc, char **argv)
+void photonTransfer2csv(std::ostream& out, const std::string& listFile, const RawImage::Masked::ptr& opticalBlack,
+                        const std::vector<double>& blackPoints, const std::shared_ptr<bitdepth_t>& whitePoint,
+                        const std::shared_ptr<ImageCrop>& crop, const Loader& load)
+{
+    const double unknown = std::numeric_limits<double>::quiet_NaN();
+    struct Pair
+    {
+        std::string fileA;
+        std::string fileB;
+        bool dark;
+        double exposure;
+        std::array<ImageMath::Stats2, 4> stats; // R, G1, G2, B
+        std::array<double, 4> black; // unknown if not provided by the -b or -m arguments
+    };
+    std::vector<Pair> pairs;
+
+    std::ifstream list(listFile.c_str());
+    if (!list) throw ImageException(VA_STR("opening " << listFile << ": " << getLastError()));
+    for (std::string line; std::getline(list, line);) // "fileA fileB [exposure|dark]" (blank lines and #comments ignored)
+    {
+        std::istringstream words(line);
+        Pair pair;
+        std::string exposure;
+        if (!(words >> pair.fileA) || (pair.fileA[0] == '#')) continue;
+        if (!(words >> pair.fileB)) throw ExitNotif { VA_STR(listFile << " must list pairs of files") };
+        words >> exposure;
+        pair.dark = String::tolower(exposure) == "dark";
+        pair.exposure = unknown;
+        if (!pair.dark && !exposure.empty() && !(std::stringstream(exposure) >> pair.exposure))
+            throw ExitNotif { VA_STR("exposure " << exposure << " is not a number nor 'dark'") };
+        pairs.push_back(pair);
+    }
+    if (pairs.empty()) throw ExitNotif { "missing flat field pairs" };
+
+    const std::size_t ahead = Parallel::threads(); // pairs being processed meanwhile
+    Parallel::run(pairs.size(), [&](std::size_t p) // a pair per thread (each one read in a single pass)
+    {
+        if (p + ahead < pairs.size())
+        {
+            RawImage::prefetch(pairs[p + ahead].fileA);
+            RawImage::prefetch(pairs[p + ahead].fileB);
+        }
+        Pair& pair = pairs[p];
+        RawImage::ptr rawA = load(pair.fileA, opticalBlack, RawImage::Access::Map);
+        RawImage::ptr rawB = load(pair.fileB, opticalBlack, RawImage::Access::Map);
+        if (!rawA->sameSizeAs(rawB)) throw ImageException(VA_STR(pair.fileA << " and " << pair.fileB << " differ in size"));
+        ImageAlgo::setBlackLevel(rawA, blackPoints);
+        ImageAlgo::setWhiteLevel(rawA, whitePoint);
+
+        ImageChannel::ptr red = rawA->getChannel(ImageFilter::R());
+        imgsize_t left = (rawA->masked.left + 1) / 2; // in channel coordinates
+        imgsize_t top = (rawA->masked.top + 1) / 2;
+        ImageSelection::ptr areaA = crop? red->select(crop) : red->select(left, top, red->width() - left, red->height() - top);
+        ImageSelection::ptr areaB = rawB->getChannel(ImageFilter::R())->select(areaA->x, areaA->y, areaA->width, areaA->height);
+        auto stats = ImageMath::subtractRGGB(areaA, areaB);
+        pair.stats = {{ stats.r, stats.g1, stats.g2, stats.b }};
+        for (std::size_t c = 0; c < 4; c++)
+            pair.black[c] = rawA->hasBlackLevel()? rawA->getChannel(ImageFilter::quad[c])->blackLevel() : unknown;
+    });
+
+    std::array<double, 4> darkLevel {{ 0, 0, 0, 0 }}; // used when the black level isn't provided
+    std::size_t darks = std::size_t(std::count_if(pairs.begin(), pairs.end(), [](const Pair& pair) { return pair.dark; }));
+    for (const auto& pair : pairs) if (pair.dark)
+        for (std::size_t c = 0; c < 4; c++) darkLevel[c] += (pair.stats[c].a.mean + pair.stats[c].b.mean) / 2 / double(darks);
+
+    std::array<ImageAlgo::PTC, 4> curves;
+    for (auto& pair : pairs)
+        for (std::size_t c = 0; c < 4; c++)
+        {
+            if (std::isnan(pair.black[c]))
+            {
+                if (!darks) throw ExitNotif { "the black level requires -b, -m or some dark pairs" };
+                pair.black[c] = darkLevel[c];
+            }
+            const ImageMath::Stats2& stats = pair.stats[c];
+            bool clipped = whitePoint && (std::max(stats.a.max, stats.b.max) >= *whitePoint);
+            double signal = (stats.a.mean + stats.b.mean) / 2 - pair.black[c];
+            curves[c].points.emplace_back(ImageAlgo::PTC::Point { pair.dark, pair.exposure, signal,
+                                                                  stats.stdev * stats.stdev, clipped });
+        }
+
+    out << "fileA;fileB;exposure";
+    for (const auto& channel : ImageFilter::quad)
+        out << ";" << channel.code << " signal;" << channel.code << " variance";
+    out << std::endl;
+    for (std::size_t p = 0; p < pairs.size(); p++)
+    {
+        out << pairs[p].fileA << ";" << pairs[p].fileB << ";";
+        if (pairs[p].dark) out << "dark"; else if (!std::isnan(pairs[p].exposure)) out << pairs[p].exposure;
+        for (const auto& curve : curves) out << ";" << curve.points[p].signal << ";" << curve.points[p].variance;
+        out << std::endl;
+    }
+
+    out << std::endl << "channel;gain(e-/DN);read noise(DN);read noise(e-);full well(e-);DR(stops);linearity(%);fitted" << std::endl;
+    for (std::size_t c = 0; c < 4; c++)
+    {
+        ImageAlgo::PTC& curve = curves[c];
+        ImageAlgo::fitPTC(curve);
+        out << ImageFilter::quad[c].code << ";" << curve.gain << ";" << curve.readNoise << ";"
+            << curve.readNoise * curve.gain << ";" << curve.fullWell << ";"
+            << std::log2(curve.fullWell / (curve.readNoise * curve.gain)) << ";";
+        if (!std::isnan(curve.linearity)) out << curve.linearity;
+        out << ";" << curve.fitted << std::endl;
+    }
+}
+
+void fpn2csv(std::ostream& out, const RawImage::ptr& rawA, const RawImage::ptr& rawB, const std::shared_ptr<ImageCrop>& crop)
+{
+    ImageChannel::ptr red = rawA->getChannel(ImageFilter::R());
+    ImageSelection::ptr areaA = crop? red->select(crop) : red->select(true); // (optical black area excluded)
+    ImageMath::LineMeansRGGB linesA = ImageMath::lineMeans(areaA);
+    double width = areaA->width, height = areaA->height;
+    auto variance = [](const std::vector<double>& values, double sign, const std::vector<double>& others)
+    {
+        double sum = 0, sum2 = 0; // of values + sign * others (if given)
+        for (std::size_t i = 0; i < values.size(); i++)
+        {
+            double value = values[i] + (others.empty()? 0 : sign * others[i]);
+            sum += value;
+            sum2 += value * value;
+        }
+        double n = double(values.size());
+        return n > 1? (sum2 - sum * sum / n) / (n - 1) : 0;
+    };
+    auto noise = [](double power) { return std::sqrt(std::max(power, 0.0)); };
+    std::array<double, 4> black;
+    for (std::size_t c = 0; c < 4; c++)
+        black[c] = rawA->hasBlackLevel()? rawA->getChannel(ImageFilter::quad[c])->blackLevel() : 0;
+
+    out << "width;height;X;Y" << std::endl
+        << areaA->width << ";" << areaA->height << ";" << areaA->x << ";" << areaA->y << std::endl << std::endl;
+
+    ImageMath::LineMeansRGGB mean = linesA; // of the pair if two frames given
+    if (!rawB) // total noise and its line components (the pixel noise averaged along the lines removed)
+    {
+        out << "channel;mean;stdev;row noise;column noise" << std::endl;
+        for (std::size_t c = 0; c < 4; c++)
+        {
+            double pixel = linesA.pixels[c].stdev * linesA.pixels[c].stdev;
+            out << ImageFilter::quad[c].code << ";" << linesA.pixels[c].mean - black[c] << ";"
+                << linesA.pixels[c].stdev << ";" << noise(variance(linesA.rows[c], 0, {}) - pixel / width) << ";"
+                << noise(variance(linesA.columns[c], 0, {}) - pixel / height) << std::endl;
+        }
+    }
+    else // temporal (from the difference of the frames) versus fixed (from their mean) components
+    {
+        if (!rawA->sameSizeAs(rawB)) throw ImageException("fpn: images size don't match");
+        ImageSelection::ptr areaB = rawB->getChannel(ImageFilter::R())->select(areaA->x, areaA->y, areaA->width, areaA->height);
+        ImageMath::LineMeansRGGB linesB = ImageMath::lineMeans(areaB);
+        ImageMath::Stats2RGGB pair = ImageMath::subtractRGGB(areaA, areaB);
+        const ImageMath::Stats2* pixels[] = { &pair.r, &pair.g1, &pair.g2, &pair.b };
+        out << "channel;mean;temporal;fixed;row temporal;row fixed;column temporal;column fixed" << std::endl;
+        for (std::size_t c = 0; c < 4; c++)
+        {
+            const ImageMath::Stats2& stats = *pixels[c];
+            double temporal = stats.stdev * stats.stdev; // var(A - B) / 2
+            double fixed = (stats.a.stdev * stats.a.stdev + stats.b.stdev * stats.b.stdev) / 2 - temporal;
+            double rowTemporal = variance(linesA.rows[c], -1, linesB.rows[c]) / 2;
+            double columnTemporal = variance(linesA.columns[c], -1, linesB.columns[c]) / 2;
+            double rowMean = variance(linesA.rows[c], 1, linesB.rows[c]) / 4;
+            double columnMean = variance(linesA.columns[c], 1, linesB.columns[c]) / 4;
+            out << ImageFilter::quad[c].code << ";" << (stats.a.mean + stats.b.mean) / 2 - black[c] << ";"
+                << noise(temporal) << ";" << noise(fixed) << ";"
+                << noise(rowTemporal - temporal / width) << ";" << noise(rowMean - rowTemporal / 2 - fixed / width) << ";"
+                << noise(columnTemporal - temporal / height) << ";"
+                << noise(columnMean - columnTemporal / 2 - fixed / height) << std::endl;
+            for (std::size_t i = 0; i < mean.rows[c].size(); i++) mean.rows[c][i] = (linesA.rows[c][i] + linesB.rows[c][i]) / 2;
+            for (std::size_t i = 0; i < mean.columns[c].size(); i++)
+                mean.columns[c][i] = (linesA.columns[c][i] + linesB.columns[c][i]) / 2;
+        }
+    }
+
+    out << std::endl << "row;R;G1;G2;B" << std::endl; // the line profiles (mean of both frames if two)
+    for (std::size_t y = 0; y < mean.rows[0].size(); y++)
+    {
+        out << areaA->y + y;
+        for (std::size_t c = 0; c < 4; c++) out << ";" << mean.rows[c][y] - black[c];
+        out << std::endl;
+    }
+    out << std::endl << "column;R;G1;G2;B" << std::endl;
+    for (std::size_t x = 0; x < mean.columns[0].size(); x++)
+    {
+        out << areaA->x + x;
+        for (std::size_t c = 0; c < 4; c++) out << ";" << mean.columns[c][x] - black[c];
+        out << std::endl;
+    }
+    out << std::endl << std::endl;
+}
+
+void nps2csv(std::ostream& out, const RawImage::ptr& raw, const ImageFilter& analyzeChannel,
+             const std::shared_ptr<ImageCrop>& crop, std::size_t tile)
+{
+    ImageSelection::ptr area = raw->getChannel(analyzeChannel)->select(crop);
+    ImageAlgo::NPS nps = ImageAlgo::noisePowerSpectrum(area, tile);
+    double variance = std::accumulate(nps.power.begin(), nps.power.end(), 0.0);
+
+    out << "width;height;X;Y;channel;tile;tiles;stdev" << std::endl
+        << area->width << ";" << area->height << ";" << area->x << ";" << area->y << ";" << analyzeChannel.code << ";"
+        << nps.tile << ";" << nps.tiles << ";" << std::sqrt(variance) << std::endl << std::endl;
+
+    out << "banding;frequency;period;power;ratio" << std::endl; // dominant frequencies (rows: horizontal stripes)
+    for (const auto& peak : nps.rowPeaks)
+        out << "row;" << peak.frequency << ";" << 1 / peak.frequency << ";" << peak.power << ";" << peak.ratio << std::endl;
+    for (const auto& peak : nps.columnPeaks)
+        out << "column;" << peak.frequency << ";" << 1 / peak.frequency << ";" << peak.power << ";" << peak.ratio << std::endl;
+
+    out << std::endl << "frequency;rows;columns" << std::endl;
+    for (std::size_t f = 1; f < nps.rows.size(); f++)
+        out << double(f) / double(tile) << ";" << nps.rows[f] << ";" << nps.columns[f] << std::endl;
+    out << std::endl << std::endl;
+}
+
+void defects2csv(std::ostream& out, const RawImage::ptr& dark, const RawImage::ptr& flat, double kappa,
+                 const std::string& mapFile)
+{
+    std::vector<DefectMap::Outliers> found;
+    DefectMap::ptr defects = DefectMap::detect(dark, flat, kappa, found);
+    defects->save(mapFile);
+    out << "channel;frame;median;sigma;low;high" << std::endl;
+    for (const auto& outliers : found)
+        out << outliers.channel << ";" << (outliers.flat? "flat" : "dark") << ";" << outliers.median << ";"
+            << outliers.sigma << ";" << outliers.low << ";" << outliers.high << std::endl;
+    const RawImage::ptr& sensor = dark? dark : flat;
+    out << "Defects=" << defects->size() << " (" << double(defects->size()) * 1e6 / double(sensor->pixelCount(false))
+        << " ppm) map { " << mapFile << " }" << std::endl;
+}
+
+void benchmark2csv(std::ostream& out, const Benchmark::Setup& setup)
+{
+    out << "operation;width;height;bits;threads;simd;ms;MPix/s;GB/s" << std::endl;
+    for (const auto& result : Benchmark::run(setup))
+        out << result.operation << ";" << setup.width << ";" << setup.height << ";" << setup.bits << ";"
+            << Parallel::threads() << ";" << Cpu::name(Cpu::simd()) << ";" << result.seconds * 1e3 << ";"
+            << result.pixels / result.seconds / 1e6 << ";" << result.bytes / result.seconds / 1e9 << std::endl;
+}
+
+int execute(const std::vector<std::string>& arguments, std::ostream& out, std::ostream& error, const Loader& load);
+
+std::vector<std::string> inputFiles(const std::string& pattern, const std::string& listFile) // sorted glob, then list
+{
+    std::vector<std::string> files;
+    if (!pattern.empty())
+    {
+#ifdef _WIN32
+        files.push_back(pattern); // no wildcards expansion available
+#else
+        glob_t matches;
+        int result = glob(pattern.c_str(), 0, nullptr, &matches);
+        if (!result) for (std::size_t m = 0; m < matches.gl_pathc; m++) files.emplace_back(matches.gl_pathv[m]);
+        globfree(&matches);
+        if (result == GLOB_NOMATCH) throw ExitNotif { VA_STR("no file matches " << pattern) };
+        if (result) throw ImageException(VA_STR("error expanding " << pattern));
+#endif
+    }
+    if (!listFile.empty())
+    {
+        std::ifstream list(listFile.c_str());
+        if (!list) throw ImageException(VA_STR("opening " << listFile << ": " << getLastError()));
+        for (std::string line; std::getline(list, line);) // a file name per line (blank lines and #comments ignored)
+        {
+            auto end = line.find_last_not_of(" \t\r");
+            if ((end != std::string::npos) && (line[0] != '#')) files.push_back(line.substr(0, end + 1));
+        }
+    }
+    if (files.empty()) throw ExitNotif { "missing input files" };
+    return files;
+}
+
+/* The CSV output of a command flattened to a single header and its rows: the sections (separated by blank lines, each
+ * a header line and its rows) are joined side by side, those of a single row (e.g. the rgbstats crop) repeated on
+ * every row of the longest one (the -loop steps). The padding of the headers (trailing empty columns) is dropped.
+ */
+static std::vector<std::string> flattenCSV(const std::string& output, std::string& header)
+{
+    struct Section
+    {
+        std::size_t columns;
+        std::vector<std::string> rows;
+    };
+    auto split = [](const std::string& line)
+    {
+        std::vector<std::string> fields;
+        std::istringstream values(line);
+        for (std::string field; std::getline(values, field, ';');) fields.push_back(field);
+        if (!line.empty() && (line.back() == ';')) fields.push_back(std::string());
+        return fields;
+    };
+    auto join = [](const std::vector<std::string>& fields, std::size_t count)
+    {
+        std::string line;
+        for (std::size_t f = 0; f < count; f++) line += (f? ";" : "") + (f < fields.size()? fields[f] : std::string());
+        return line;
+    };
+
+    std::vector<Section> sections;
+    std::istringstream lines(output);
+    bool blank = true;
+    for (std::string line; std::getline(lines, line);)
+    {
+        if (line.empty()) { blank = true; continue; }
+        std::vector<std::string> fields = split(line);
+        if (blank) // a new section header
+        {
+            while (!fields.empty() && fields.back().empty()) fields.pop_back();
+            sections.push_back(Section { fields.size(), std::vector<std::string>() });
+            header += (header.empty()? "" : ";") + join(fields, fields.size());
+        }
+        else sections.back().rows.push_back(join(fields, sections.back().columns));
+        blank = false;
+    }
+
+    std::size_t count = 0;
+    for (const auto& section : sections) count = std::max(count, section.rows.size());
+    std::vector<std::string> rows(count);
+    for (std::size_t r = 0; r < count; r++)
+        for (std::size_t s = 0; s < sections.size(); s++)
+        {
+            const std::vector<std::string>& values = sections[s].rows;
+            std::string row = values.size() == 1? values.front() : r < values.size()? values[r]
+                            : join(std::vector<std::string>(), sections[s].columns); // (empty columns)
+            rows[r] += (s? ";" : "") + row;
+        }
+    return rows;
+}
+
+/* Runs the command once per input file, the files being distributed among the worker threads while the next ones
+ * are read ahead. The outputs are written in the files order as soon as available, CSV ones merged into a single
+ * table with a leading file name column (see flattenCSV: a row per file or per -loop step, the header written once).
+ */
+static thread_local bool batched = false; // executing the command for one of the files
+
+int batch(const std::vector<std::string>& command, const std::vector<std::string>& files, bool csv,
+          std::ostream& out, std::ostream& error, const Loader& load)
+{
+    struct Result
+    {
+        std::string out;
+        std::string error;
+        int status;
+        bool done;
+    };
+    std::vector<Result> results(files.size());
+    std::size_t written = 0;
+    std::string header;
+    int status = 0;
+    std::mutex mutex;
+
+    auto write = [&](const std::string& fileName, const Result& result)
+    {
+        if (!csv) out << result.out;
+        else if (!result.status) // (failed commands leave a partial table: their error reported alone)
+        {
+            std::string fileHeader;
+            std::vector<std::string> rows = flattenCSV(result.out, fileHeader);
+            if (header.empty() && !rows.empty()) out << "file;" << (header = fileHeader) << '\n';
+            for (const auto& row : rows) out << fileName << ";" << row << '\n';
+        }
+        out.flush();
+        auto message = result.error.find_first_not_of('\n');
+        if (message != std::string::npos) error << fileName << ": " << result.error.substr(message) << std::flush;
+        status = std::max(status, result.status);
+    };
+
+    const std::size_t ahead = Parallel::threads(); // files being processed meanwhile
+    Parallel::run(files.size(), [&](std::size_t f)
+    {
+        if (f + ahead < files.size()) RawImage::prefetch(files[f + ahead]); // I/O overlapped with the computations
+        std::vector<std::string> arguments(command);
+        arguments.push_back("-i");
+        arguments.push_back(files[f]);
+        std::ostringstream fileOut, fileError;
+        batched = true; // (names with wildcard characters aren't patterns anymore)
+        int fileStatus = execute(arguments, fileOut, fileError, load); // single threaded (nested parallel runs)
+        batched = false;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        results[f] = Result { fileOut.str(), fileError.str(), fileStatus, true };
+        for (; (written < files.size()) && results[written].done; written++)
+        {
+            write(files[written], results[written]);
+            results[written] = Result { std::string(), std::string(), 0, true }; // release the memory
+        }
+    });
+
+    return status;
+}
+
+int execute(const std::vector<std::string>& arguments, std::ostream& out, std::ostream& error, const Loader& loader)
 {
+    std::vector<const char*> pointers;
+    for (const auto& argument : arguments) pointers.push_back(argument.c_str());
+    const char* const* argv = pointers.data();
+    int argc = int(pointers.size());
     try
     {
         int argument = 0;
         std::string command = String::tolower(argc > 1? argv[++argument] : "help");
         ImageAlgo::DPRAW::Action dprawAction = ImageAlgo::DPRAW::Action::GetA;
         ImageAlgo::DPRAW::ProcessMode dprawProcessMode = ImageAlgo::DPRAW::ProcessMode::Plain;
+        ImageAlgo::Stack::Mode stackMode = ImageAlgo::Stack::Mode::Mean;
 
         std::string infile1;
         std::string infile2;
+        std::string listFile;
         RawImage::Masked::ptr opticalBlack;
         std::string outfile;
+        std::string stdevfile;
+        double kappa = 0; // the default of the command if not given
         std::vector<double> blackPoints;
         std::shared_ptr<bitdepth_t> whitePoint;
         std::shared_ptr<ImageFilter> channel;
@@ -339,6 +739,16 @@ int main(int argc, char **argv)
         std::shared_ptr<ImageCrop> crop;
         std::shared_ptr<Loop> loop;
         bool verbose = false;
+        bool indexed = false;
+        bool streamed = false;
+        std::string socketPath;
+        std::size_t cacheFrames = 4;
+        Benchmark::Setup bench { 6000, 4000, 14, 3, "hraw_bench.pgm" };
+        std::shared_ptr<RawImage::Packed> packed;
+        std::shared_ptr<Cfa> cfa;
+        std::string defectsFile;
+        std::size_t tile = 64;
+        std::string profile; // report format ("text" or "json"), empty if not profiling
 
         if (command == "dpraw")
         {
@@ -352,6 +762,13 @@ int main(int argc, char **argv)
             if (smod.fail()) throw ExitNotif { "dpraw processing mode must be Plain or Bayer" };
         }
 
+        else if (command == "stack")
+        {
+            std::stringstream smod(argument + 1 >= argc? "" : String::toupper(argv[++argument]));
+            smod >> stackMode;
+            if (smod.fail()) throw ExitNotif { "stack requires a mode: Mean, Median or Sigma" };
+        }
+
         for (++argument; argument < argc; argument++)
         {
             std::string argname = String::tolower(argv[argument]);
@@ -366,6 +783,11 @@ int main(int argc, char **argv)
                 infile1 = argv[++argument];
                 infile2 = argv[++argument];
             }
+            else if (argname == "-l")
+            {
+                if (argument + 1 >= argc) throw ExitNotif { "-l requires a file with the input file names" };
+                listFile = argv[++argument];
+            }
             else if (argname == "-m")
             {
                 if (argument + 2 >= argc) throw ExitNotif { "-m requires the left and top mask numbers" };
@@ -378,6 +800,16 @@ int main(int argc, char **argv)
                 if (argument + 1 >= argc) throw ExitNotif { "-o requires a output file name" };
                 outfile = argv[++argument];
             }
+            else if (argname == "-s")
+            {
+                if (argument + 1 >= argc) throw ExitNotif { "-s requires a output file name" };
+                stdevfile = argv[++argument];
+            }
+            else if (argname == "-k")
+            {
+                if (argument + 1 >= argc) throw ExitNotif { "-k requires a floating point number" };
+                if (!(std::stringstream(argv[++argument]) >> kappa)) throw ExitNotif { "-k requires a number" };
+            }
             else if (argname == "-b")
             {
                 blackPoints.resize(4);
@@ -424,6 +856,81 @@ int main(int argc, char **argv)
                 std::stringstream(argv[++argument]) >> loop->deltaY;
                 std::stringstream(argv[++argument]) >> loop->count;
             }
+            else if (argname == "-j")
+            {
+                if (argument + 1 >= argc) throw ExitNotif { "-j requires the number of threads" };
+                long long threads = 0;
+                if (!(std::stringstream(argv[++argument]) >> threads)) throw ExitNotif { "-j requires a number" };
+                long long most = 4 * std::max(1u, std::thread::hardware_concurrency());
+                if ((threads < 0) || (threads > most))
+                    throw ExitNotif { VA_STR("-j threads must be from 1 to " << most << " (0: all cores)") };
+                Parallel::setThreads(unsigned(threads));
+            }
+            else if (argname == "-packed")
+            {
+                if (argument + 3 >= argc) throw ExitNotif { "-packed requires the format, width and height" };
+                packed = std::make_shared<RawImage::Packed>();
+                if (!(std::stringstream(argv[++argument]) >> packed->format))
+                    throw ExitNotif { "-packed format must be RAW10, RAW12, LE12 or LE14" };
+                if (!(std::stringstream(argv[++argument]) >> packed->width)) throw ExitNotif { "-packed width must be a number" };
+                if (!(std::stringstream(argv[++argument]) >> packed->height)) throw ExitNotif { "-packed height must be a number" };
+            }
+            else if (argname == "-cfa")
+            {
+                if (argument + 1 >= argc) throw ExitNotif { "-cfa requires the color filter array pattern" };
+                cfa = std::make_shared<Cfa>();
+                if (!(std::stringstream(argv[++argument]) >> cfa->pattern))
+                    throw ExitNotif { "-cfa requires RGGB, BGGR, GRBG, GBRG, QUAD or XTRANS" };
+            }
+            else if (argname == "-d")
+            {
+                if (argument + 1 >= argc) throw ExitNotif { "-d requires the defect map file name" };
+                defectsFile = argv[++argument];
+            }
+            else if (argname == "-tile")
+            {
+                if (argument + 1 >= argc) throw ExitNotif { "-tile requires the size of the tiles" };
+                if (!(std::stringstream(argv[++argument]) >> tile)) throw ExitNotif { "-tile requires a number" };
+            }
+            else if (argname == "-socket")
+            {
+                if (argument + 1 >= argc) throw ExitNotif { "-socket requires a path" };
+                socketPath = argv[++argument];
+            }
+            else if (argname == "-cache")
+            {
+                if (argument + 1 >= argc) throw ExitNotif { "-cache requires the number of frames" };
+                if (!(std::stringstream(argv[++argument]) >> cacheFrames)) throw ExitNotif { "-cache requires a number" };
+            }
+            else if (argname == "-size")
+            {
+                if (argument + 2 >= argc) throw ExitNotif { "-size requires the width and height" };
+                if (!(std::stringstream(argv[++argument]) >> bench.width)) throw ExitNotif { "-size requires two numbers" };
+                if (!(std::stringstream(argv[++argument]) >> bench.height)) throw ExitNotif { "-size requires two numbers" };
+            }
+            else if (argname == "-bits")
+            {
+                if (argument + 1 >= argc) throw ExitNotif { "-bits requires the bit depth" };
+                if (!(std::stringstream(argv[++argument]) >> bench.bits)) throw ExitNotif { "-bits requires a number" };
+            }
+            else if (argname == "-runs")
+            {
+                if (argument + 1 >= argc) throw ExitNotif { "-runs requires the number of repetitions" };
+                if (!(std::stringstream(argv[++argument]) >> bench.runs)) throw ExitNotif { "-runs requires a number" };
+            }
+            else if (argname == "-index")
+            {
+                indexed = true;
+            }
+            else if (argname == "-stream")
+            {
+                streamed = true;
+            }
+            else if (argname == "--profile")
+            {
+                profile = "text";
+                if ((argument + 1 < argc) && (String::tolower(argv[argument + 1]) == "json")) profile = "json", argument++;
+            }
             else if (argname == "-v")
             {
                 verbose = true;
@@ -434,13 +941,61 @@ int main(int argc, char **argv)
             }
         }
 
+        bool profiling = !profile.empty() && !batched; // (the files of a batch measured as a whole)
+        if (profiling) Profile::start();
+        struct Profiling { bool active; ~Profiling() { if (active) Profile::stop(); } } profiled { profiling };
+
+        bool multiple = (command == "ptc") || (command == "stack"); // several input files handled by the command
+        if (!batched && !multiple && (!listFile.empty() || (infile1.find_first_of("*?[") != std::string::npos))) // several files
+        {
+            bool csv = (command == "histogram") || (command == "stats") || (command == "rgbstats");
+            if (!csv && (command != "mskstats") && (command != "clipping"))
+                throw ExitNotif { VA_STR(command << " does not support multiple input files") };
+            if (!outfile.empty()) throw ExitNotif { "-o can't be used with multiple input files" };
+            std::vector<std::string> common; // the arguments not specific of this invocation
+            for (std::size_t a = 0; a < arguments.size(); a++)
+            {
+                std::string argname = String::tolower(arguments[a]);
+                if ((a > 1) && ((argname == "-i") || (argname == "-l") || (argname == "-j"))) a++;
+                else common.push_back(arguments[a]);
+            }
+            int status = batch(common, inputFiles(infile1, listFile), csv, out, error, loader);
+            if (profiling) Profile::report(error, command, profile == "json");
+            return status;
+        }
+
+        Loader load = loader;
+        if (streamed) load = [loader](const std::string& fileName, const RawImage::Masked::ptr& mask, RawImage::Access access)
+        {
+            return loader(fileName, mask, access == RawImage::Access::Map? RawImage::Access::Stream : access);
+        };
+        if (packed) load = [packed](const std::string& fileName, const RawImage::Masked::ptr& mask, RawImage::Access)
+        {
+            return RawImage::load(fileName, *packed, mask); // (always read: the samples must be unpacked)
+        };
+        if (cfa) load = [load, cfa](const std::string& fileName, const RawImage::Masked::ptr& mask, RawImage::Access access)
+        {
+            RawImage::ptr raw = load(fileName, mask, access);
+            raw->cfa = *cfa;
+            return raw;
+        };
+        DefectMap::ptr defects = defectsFile.empty()? DefectMap::ptr() : DefectMap::load(defectsFile);
+        if (defects) load = [load, defects](const std::string& fileName, const RawImage::Masked::ptr& mask, RawImage::Access access)
+        {
+            RawImage::ptr raw = load(fileName, mask, access);
+            if (!defects->fits(*raw)) throw ImageException(VA_STR(fileName << ": size doesn't match the defect map"));
+            raw->defects = defects;
+            return raw;
+        };
+
         if (command == "histogram")
         {
             if (infile1.empty()) throw ExitNotif { "missing input file" };
-            RawImage::ptr raw = RawImage::load(infile1, opticalBlack);
+            RawImage::ptr raw = load(infile1, opticalBlack, RawImage::Access::Map);
+            raw->deinterleave();
             ImageAlgo::setBlackLevel(raw, blackPoints);
             ImageAlgo::setWhiteLevel(raw, whitePoint);
-            histogram2csv(raw, crop);
+            histogram2csv(out, raw, crop);
         }
         else if (command == "clipping")
         {
@@ -451,7 +1006,7 @@ int main(int argc, char **argv)
                 if (ep == std::string::npos) ep = infile1.length();
                 outfile = infile1.substr(0, ep) + ".tiff";
             }
-            RawImage::ptr raw = RawImage::load(infile1, opticalBlack);
+            RawImage::ptr raw = load(infile1, opticalBlack, RawImage::Access::Copy);
             ImageAlgo::setBlackLevel(raw, blackPoints);
             ImageAlgo::setWhiteLevel(raw, whitePoint);
             double clipped = -1;
@@ -462,9 +1017,9 @@ int main(int argc, char **argv)
                 ImageAlgo::Levels levels = ImageAlgo::autoLevels(histogram);
                 if (!whitePoint) ImageAlgo::setWhiteLevel(raw, std::make_shared<bitdepth_t>(levels.whiteLevel));
                 if (!raw->hasBlackLevel()) ImageAlgo::setBlackLevel(raw, std::vector<double>({double(levels.blackLevel)}));
-                clipped = levels.clippedCount*100.0/double(histogram->total);
+                clipped = double(levels.clippedCount) * 100.0 / double(histogram->total);
             }
-            if (verbose) std::cout << "BlackLevel=" << bitdepth_t(std::round(raw->blackLevel[ImageFilter::Code::RGB]))
+            if (verbose) out << "BlackLevel=" << bitdepth_t(std::round(raw->blackLevel[ImageFilter::Code::RGB]))
                                    << " WhiteLevel=" << *raw->whiteLevel
                                    << (clipped < 0? "" : VA_STR(" Clipped=" << clipped << "%")) << std::endl;
             RawImage::ptr result = ImageAlgo::clipping(raw);
@@ -473,26 +1028,29 @@ int main(int argc, char **argv)
         else if (command == "stats")
         {
             if (infile1.empty()) throw ExitNotif { "missing input file" };
-            auto raw = RawImage::load(infile1, opticalBlack);
+            auto raw = load(infile1, opticalBlack, RawImage::Access::Map);
+            if (indexed) raw->buildIndex(infile1);
             ImageAlgo::setBlackLevel(raw, blackPoints);
             ImageAlgo::setWhiteLevel(raw, whitePoint);
-            stats(raw, channel? *channel : ImageFilter::RGB(), crop);
+            stats(out, raw, channel? *channel : ImageFilter::RGB(), crop);
         }
         else if (command == "mskstats")
         {
             if (infile1.empty()) throw ExitNotif { "missing input file" };
             if (!channel) throw ExitNotif { "image channel must be specified" };
             if (!opticalBlack) throw ExitNotif { "left and top mask must be specified" };
-            auto raw = RawImage::load(infile1, opticalBlack);
+            auto raw = load(infile1, opticalBlack, RawImage::Access::Map);
+            if (indexed) raw->buildIndex(infile1);
             ImageAlgo::setWhiteLevel(raw, whitePoint);
-            mskstats(raw, *channel);
+            mskstats(out, raw, *channel);
         }
         else if (command == "rgbstats")
         {
             if (infile1.empty()) throw ExitNotif { "missing input file" };
-            RawImage::ptr raw = RawImage::load(infile1, opticalBlack);
+            RawImage::ptr raw = load(infile1, opticalBlack, RawImage::Access::Map);
+            if (indexed) raw->buildIndex(infile1);
             ImageAlgo::setBlackLevel(raw, blackPoints);
-            rgbStats2csv(raw, crop, loop);
+            rgbStats2csv(out, raw, crop, loop);
         }
         else if (command == "dpraw")
         {
@@ -501,49 +1059,136 @@ int main(int argc, char **argv)
             if (outfile.empty()) throw ExitNotif { "missing output file for result" };
             if (!whitePoint) throw ExitNotif { "white point must be specified" };
             if (!ev && (dprawAction != ImageAlgo::DPRAW::Action::GetA)) throw ExitNotif { "EV shift must be specified" };
-            RawImage::ptr rawAB = RawImage::load(infile1, opticalBlack);
-            RawImage::ptr rawB  = RawImage::load(infile2, opticalBlack);
+            RawImage::ptr rawAB = load(infile1, opticalBlack, RawImage::Access::Copy);
+            RawImage::ptr rawB  = load(infile2, opticalBlack, RawImage::Access::Copy);
             ImageAlgo::setBlackLevel(rawAB, blackPoints);
             ImageAlgo::setBlackLevel(rawB, blackPoints);
             ImageAlgo::DPRAW dpraw { rawAB, rawB, *whitePoint, ev };
             RawImage::ptr result = ImageAlgo::dprawProcess(dpraw, dprawAction, dprawProcessMode);
             result->save(outfile);
         }
+        else if (command == "ptc")
+        {
+            if (listFile.empty()) throw ExitNotif { "missing list of flat field pairs" };
+            photonTransfer2csv(out, listFile, opticalBlack, blackPoints, whitePoint, crop, load);
+        }
+        else if (command == "stack")
+        {
+            if (outfile.empty() && stdevfile.empty()) throw ExitNotif { "missing output file for result" };
+            std::vector<RawImage::ptr> frames;
+            for (const auto& fileName : inputFiles(infile1, listFile))
+                frames.push_back(load(fileName, RawImage::Masked::ptr(), RawImage::Access::Stream)); // (never resident)
+            ImageAlgo::Stack stack = ImageAlgo::stack(frames, stackMode, kappa > 0? kappa : 3);
+            if (!outfile.empty()) stack.average->save(outfile);
+            if (!stdevfile.empty()) stack.stdev->save(stdevfile);
+        }
+        else if (command == "fpn")
+        {
+            if (infile1.empty()) throw ExitNotif { "missing input file" };
+            RawImage::ptr rawA = load(infile1, opticalBlack, RawImage::Access::Map);
+            RawImage::ptr rawB = infile2.empty()? RawImage::ptr() : load(infile2, opticalBlack, RawImage::Access::Map);
+            ImageAlgo::setBlackLevel(rawA, blackPoints);
+            fpn2csv(out, rawA, rawB, crop);
+        }
+        else if (command == "nps")
+        {
+            if (infile1.empty()) throw ExitNotif { "missing input file" };
+            RawImage::ptr raw = load(infile1, opticalBlack, RawImage::Access::Map);
+            nps2csv(out, raw, channel? *channel : ImageFilter::RGB(), crop, tile);
+        }
+        else if (command == "defects")
+        {
+            if (infile1.empty()) throw ExitNotif { "missing input file" };
+            if (outfile.empty()) throw ExitNotif { "missing output file for the defect map" };
+            RawImage::ptr dark = load(infile1, opticalBlack, RawImage::Access::Map);
+            RawImage::ptr flat = infile2.empty()? RawImage::ptr() : load(infile2, opticalBlack, RawImage::Access::Map);
+            defects2csv(out, dark, flat, kappa > 0? kappa : 6, outfile);
+        }
+        else if (command == "bench")
+        {
+            if (!outfile.empty()) bench.scratch = outfile;
+            benchmark2csv(out, bench);
+        }
+        else if (command == "serve")
+        {
+            static bool serving = false;
+            if (serving) throw ExitNotif { "already serving" };
+            serving = true;
+            FrameCache cache(cacheFrames);
+            Loader cached = [&cache](const std::string& fileName, const RawImage::Masked::ptr& mask, RawImage::Access)
+            {
+                return cache.load(fileName, mask);
+            };
+            Server::Handler handler = [&](const std::vector<std::string>& words, std::ostream& response)
+            {
+                std::vector<std::string> request { argv[0] };
+                request.insert(request.end(), words.begin(), words.end());
+                return execute(request, response, response, cached);
+            };
+            if (socketPath.empty()) Server::serve(std::cin, out, handler); else Server::listen(socketPath, handler);
+        }
         else
         {
             throw ExitNotif();
         }
+
+        if (profiling) Profile::report(error, command, profile == "json");
     }
     catch (ExitNotif& err)
     {
         if (err.errMsg.empty())
         {
-            std::cout
+            out
             << std::endl
             << "  HRAW v1.1 - Hacker's open source toolkit for image sensor characterisation" << std::endl
             << "              (c) 2016-2018 Ciriaco Garcia de Celis" << std::endl
             << std::endl
             << "    Commands:" << std::endl
-            << "      histogram -i [-b|-m] [-w] [-crop]" << std::endl
-            << "      clipping  -i [-b|-m] [-w] [-o(tiff/ppm)] [-v]" << std::endl
-            << "      stats     -i [-c] [-b] [-w] [-crop]" << std::endl
-            << "      mskstats  -i -c -m [-w]" << std::endl
-            << "      rgbstats  -i [-b|-m] [-crop] [-loop]" << std::endl
+            << "      histogram -i|-l [-b|-m] [-w] [-crop]" << std::endl
+            << "      clipping  -i|-l [-b|-m] [-w] [-o(tiff/ppm)] [-v]" << std::endl
+            << "      stats     -i|-l [-c] [-b] [-w] [-crop] [-index]" << std::endl
+            << "      mskstats  -i|-l -c -m [-w] [-index]" << std::endl
+            << "      rgbstats  -i|-l [-b|-m] [-crop] [-loop] [-index]" << std::endl
             << "      dpraw      GetA|Blend Plain|Bayer -i2 AB_0.pgm B_1.pgm -o(dat/pgm) -m|-b -w [-ev]" << std::endl
+            << "      ptc       -l [-b|-m] [-w] [-crop]  (-l lines: flatA.pgm flatB.pgm [exposure|dark])" << std::endl
+            << "      stack      Mean|Median|Sigma -i|-l -o(dat/pgm) [-s(dat/pgm)] [-k]" << std::endl
+            << "      fpn       -i|-i2 [-b|-m] [-crop]  (row & column fixed pattern noise, temporal apart if two frames)" << std::endl
+            << "      nps       -i [-c] [-crop] [-tile]  (noise power spectrum: dominant row & column banding frequencies)" << std::endl
+            << "      defects   -i dark.pgm|-i2 dark.pgm flat.pgm -o(txt) [-m] [-k]  (hot, dead & stuck pixels map)" << std::endl
+            << "      serve     [-socket] [-cache]  (a command per input line, each output ended by \"#END status\")" << std::endl
+            << "      bench     [-size] [-bits] [-runs] [-o(pgm)]  (synthetic frames timings: CSV with MPix/s and GB/s)" << std::endl
             << std::endl
             << "    Arguments:" << std::endl
-            << "      -i fileName.pgm            single input file" << std::endl
+            << "      -i fileName.pgm            single input file (or a quoted wildcard pattern: several files)" << std::endl
+            << "      -l fileList.txt            several input files (one name per line), also allowed with -i" << std::endl
             << "      -i2 file1.pgm file2.pgm    two input files" << std::endl
             << "      -m leftMask topMask        masked pixels count (optical black area)" << std::endl
             << "      -o fileName.ext            output file (.dat .pgm .ppm or .tiff depending on command)" << std::endl
+            << "      -s fileName.ext            per pixel standard deviation output file (.dat or .pgm)" << std::endl
+            << "      -k kappa                   sigma clipping threshold in standard deviations (3 by default, defects: 6)" << std::endl
             << "      -b blackPoint(s)           a single floating point number or 4 (one for each channel)" << std::endl
             << "      -w whitePoint              integer number (black point not substracted)" << std::endl
             << "      -c R|G1|G2|G|B|RGB         color filter selection" << std::endl
             << "      -ev EV                     exposure adjust (positive or negative)" << std::endl
             << "      -crop cx cy width height   rectangle selection (bayer coordinates: half width & height)" << std::endl
             << "      -loop deltaX deltaY count  multiline output moving the selection" << std::endl
+            << "      -packed fmt width height   headerless RAW10 or RAW12 (MIPI packed), LE12 or LE14 (16-bit) input" << std::endl
+            << "      -cfa pattern               RGGB (default), BGGR, GRBG, GBRG, QUAD (4x4) or XTRANS (6x6)" << std::endl
+            << "                                 (QUAD, XTRANS: only stats -c R|G|B|RGB, their -crop in periods, defects, stack," << std::endl
+            << "                                 mskstats -c RGB and nps -c RGB; the other commands need the 2x2 quads)" << std::endl
+            << "      -tile size                 side of the square tiles of nps, a power of two (64 by default)" << std::endl
+            << "      -socket path               Unix domain socket to listen on (instead of the standard input)" << std::endl
+            << "      -cache frames              images kept in memory by the server (4 by default)" << std::endl
+            << "      -size width height         synthetic frame dimensions (6000 4000 by default)" << std::endl
+            << "      -bits bitDepth             synthetic frame bit depth, 8 to 16 (14 by default)" << std::endl
+            << "      -runs count                repetitions of each benchmark, the best one reported (3 by default)" << std::endl
+            << "      --profile [json]           time, pixels and bytes of every processing stage (to the error output)" << std::endl
+            << "      -d defects.txt             defect map: those pixels replaced by the mean of their neighbours" << std::endl
+            << "      -index                     summed-area tables reused from fileName.pgm.sat (built if missing)" << std::endl
+            << "      -stream                    rows read from the files when needed (images larger than the memory)" << std::endl
+            << "      -j threads                 worker threads (default: all cores; the results do not depend on it)" << std::endl
             << std::endl
-            << "    Input PGM files previously generated from camera raw files with dcraw:" << std::endl
+            << "    Input PGM files previously generated from camera raw files with dcraw (or sensor dumps, see -packed):" << std::endl
             << "      dcraw -D -4 -j -t 0 -s all  (plain non demosaiced raw image data)" << std::endl
             << "      dcraw -E -4 -j -t 0 -s all  (request including the masked pixels for the -m option)" << std::endl
             << std::endl
@@ -554,16 +1199,25 @@ int main(int argc, char **argv)
         }
         else
         {
-            std::cerr << std::endl << "ERROR: " << err.errMsg << std::endl
-                      << "Run the application with no arguments for help" << std::endl << std::endl;
+            error << std::endl << "ERROR: " << err.errMsg << std::endl
+                  << "Run the application with no arguments for help" << std::endl << std::endl;
             return 2;
         }
     }
     catch (ImageException& e)
     {
-        std::cerr << e.what() << std::endl;
+        error << e.what() << std::endl;
         return 3;
     }
 
     return 0;
 }
+
+int main(int argc, char **argv)
+{
+    Loader load = [](const std::string& fileName, const RawImage::Masked::ptr& opticalBlack, RawImage::Access access)
+    {
+        return RawImage::load(fileName, opticalBlack, access);
+    };
+    return execute(std::vector<std::string>(argv, argv + argc), std::cout, std::cerr, load);
+}